@@ -104,8 +104,8 @@ static void xsem_init(sem_t *sem, int pshared, unsigned int value)
 	}
 }
 
-static void xpthread_create(pthread_t *thread, const pthread_attr_t *attr,
-			    void *(*start_routine)(void *), void *arg)
+void xpthread_create(pthread_t *thread, const pthread_attr_t *attr,
+		     void *(*start_routine)(void *), void *arg)
 {
 	int ret;
 
@@ -116,7 +116,7 @@ static void xpthread_create(pthread_t *thread, const pthread_attr_t *attr,
 	}
 }
 
-static void xpthread_join(pthread_t thread, void **retval)
+void xpthread_join(pthread_t thread, void **retval)
 {
 	int ret;
 
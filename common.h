@@ -19,6 +19,7 @@
 #ifndef __COMMON_H
 #define __COMMON_H
 
+#include <pthread.h>
 #include <semaphore.h>
 
 struct worker_thread {
@@ -31,6 +32,10 @@ struct worker_thread {
 ssize_t xpread(int fd, void *buf, size_t count, off_t offset);
 ssize_t xpwrite(int fd, const void *buf, size_t count, off_t offset);
 
+void xpthread_create(pthread_t *thread, const pthread_attr_t *attr,
+		     void *(*start_routine)(void *), void *arg);
+void xpthread_join(pthread_t thread, void **retval);
+
 void xsem_post(sem_t *sem);
 void xsem_wait(sem_t *sem);
 void run_threads(void *(*handler)(void *), void *cookie);
@@ -6,8 +6,14 @@
 #include <fcntl.h>
 #include <iv_avl.h>
 #include <iv_list.h>
+#include <limits.h>
+#ifdef HAVE_NUMA
+#include <numa.h>
+#endif
 #include <pthread.h>
+#include <stddef.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -16,20 +22,405 @@
 
 #define ROUND_UP(x, y)	((((x) + (y) - 1) / (y)) * (y))
 
-#define TREES		16777216
-
-static struct {
-	struct iv_avl_tree	frags;
-	pthread_mutex_t		lock;
-} frags[TREES];
+/*
+ * The fragment index is an array of AVL trees, indexed by the leading
+ * bits of the fragment hash.  The array is sized from an estimate of
+ * the number of input lines and allocated with anonymous mmap(), so
+ * that memory is only touched as trees get used.  An all-zeroes tree is
+ * a valid empty tree, and is given its comparison function on first
+ * insertion.  The trees are protected by a fixed set of striped
+ * locks, which is small enough to initialize up front.  With -N, each
+ * NUMA node has a set of stripes of its own, placed on that node, and
+ * covering only the trees of that node (see tree_lock()).
+ */
+#define MIN_TREE_BITS	10
+#define MAX_TREE_BITS	24
+#define FRAGS_PER_TREE	4
+#define LOCK_STRIPES	65536
+#define MAX_NODES	64
+
+/*
+ * The shortest possible input line: a hash, a one-digit length and
+ * the separating space and newline.
+ */
+#define MIN_LINE_LENGTH	(2 * HASH_LENGTH + 3)
+
+static int tree_bits;
+static int num_trees;
+static struct iv_avl_tree *frags;
+static pthread_mutex_t *tree_locks[MAX_NODES];
+static int numa;
+static int num_nodes;
 
 struct frag {
 	struct iv_avl_node	an;
 	uint8_t			hash[HASH_LENGTH];
-	uint64_t		length;
+	uint16_t		stream;
+	uint16_t		has_location;
 	int			count;
+	uint64_t		length;
+};
+
+/*
+ * Fragments first seen on a line that carries a location (hashfrags
+ * -l) are allocated with room to remember one, so that input without
+ * locations doesn't pay for them.
+ */
+struct located_frag {
+	struct frag		f;
+	const char		*file;
+	uint64_t		offset;
+};
+
+/*
+ * Lookups in the index go to random places in it, so on large runs
+ * almost every one of them misses the TLB.  With -H, the tree array
+ * and the fragment records are backed by huge pages: "thp" asks for
+ * transparent huge pages, and "2M" and "1G" ask for hugetlbfs pages
+ * of that size for the tree array, falling back to transparent huge
+ * pages if none are available.  Fragment records are then carved out
+ * of per-thread arenas rather than malloc()ed one by one.  Arenas are
+ * always backed by transparent huge pages, as giving every thread a
+ * hugetlbfs arena would quickly use up the (usually small) reserved
+ * pool, and with 1G pages, would waste most of each page.
+ *
+ * With -N, the tree array is split into one range of hash prefixes
+ * per NUMA node, with each range placed on its node, and records are
+ * inserted by threads running on the node that owns them (see
+ * route_frag()).  Arena memory is allocated by those threads, so it
+ * is local to their node as well.
+ */
+#define ARENA_SIZE	(64 << 20)
+
+static int use_thp;
+static int hugetlb_flags;
+static size_t index_page_size = 4096;
+static int use_arenas;
+
+static void *alloc_thp_mem(size_t size)
+{
+	void *ptr;
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED) {
+		fprintf(stderr, "out of memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (use_thp || hugetlb_flags)
+		madvise(ptr, size, MADV_HUGEPAGE);
+
+	return ptr;
+}
+
+static void *alloc_index_mem(size_t size)
+{
+	static int warned;
+	void *ptr;
+
+	size = ROUND_UP(size, index_page_size);
+
+	if (hugetlb_flags) {
+		ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | hugetlb_flags, -1, 0);
+		if (ptr != MAP_FAILED)
+			return ptr;
+
+		if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) {
+			fprintf(stderr, "no huge pages available, using "
+					"transparent huge pages\n");
+		}
+	}
+
+	return alloc_thp_mem(size);
+}
+
+static __thread uint8_t *arena;
+static __thread size_t arena_left;
+
+static void *alloc_frag(size_t size)
+{
+	void *f;
+
+	if (!use_arenas) {
+		f = malloc(size);
+		if (f == NULL) {
+			fprintf(stderr, "out of memory!\n");
+			exit(EXIT_FAILURE);
+		}
+
+		return f;
+	}
+
+	if (arena_left < size) {
+		arena_left = ARENA_SIZE;
+		arena = alloc_thp_mem(arena_left);
+	}
+
+	f = arena;
+	arena += size;
+	arena_left -= size;
+
+	return f;
+}
+
+/*
+ * hashfrags can tag its output lines with the name of the stream
+ * (e.g. the chunking threshold) that they belong to.  Fragments of
+ * different streams are counted separately, and summarized side by
+ * side.  Untagged lines belong to the unnamed stream.  The stream
+ * table is append-only, so it can be searched without the lock.
+ */
+#define MAX_STREAMS	32
+
+static pthread_mutex_t streams_lock = PTHREAD_MUTEX_INITIALIZER;
+static int num_streams;
+static char *stream_names[MAX_STREAMS];
+
+static int find_stream(const char *name)
+{
+	int num;
+	int i;
+
+	num = __atomic_load_n(&num_streams, __ATOMIC_ACQUIRE);
+	for (i = 0; i < num; i++) {
+		if (!strcmp(stream_names[i], name))
+			return i;
+	}
+
+	pthread_mutex_lock(&streams_lock);
+
+	for (i = num; i < num_streams; i++) {
+		if (!strcmp(stream_names[i], name))
+			break;
+	}
+
+	if (i == num_streams) {
+		if (i == MAX_STREAMS) {
+			fprintf(stderr, "too many streams\n");
+			exit(EXIT_FAILURE);
+		}
+
+		stream_names[i] = strdup(name);
+		if (stream_names[i] == NULL) {
+			fprintf(stderr, "out of memory!\n");
+			exit(EXIT_FAILURE);
+		}
+
+		__atomic_store_n(&num_streams, i + 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&streams_lock);
+
+	return i;
+}
+
+/*
+ * With -s k, countfrags keeps a bottom-k sketch of the fragments of
+ * each stream of each source file, i.e. the k smallest distinct 64-bit
+ * prefixes of their hashes.  The source of a fragment is the file
+ * named in its location if the line has one, and the input file that
+ * the line was read from otherwise.  Once all input has been read, the
+ * sketches are used to estimate the pairwise similarity of all sources
+ * within each stream.
+ *
+ * Values at or above thresh can't enter the sketch, which is checked
+ * without taking the lock, so that the lock is only taken for the
+ * few fragments that make it into the sketch.
+ */
+static int sketch_k;
+static double min_similarity;
+
+struct sketch {
+	pthread_mutex_t	lock;
+	uint64_t	thresh;
+	int		num;
+	uint64_t	values[];
+};
+
+static struct sketch *alloc_sketch(void)
+{
+	struct sketch *sk;
+
+	sk = malloc(sizeof(*sk) + sketch_k * sizeof(sk->values[0]));
+	if (sk == NULL) {
+		fprintf(stderr, "out of memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutex_init(&sk->lock, NULL);
+	sk->thresh = UINT64_MAX;
+	sk->num = 0;
+
+	return sk;
+}
+
+static void sketch_add(struct sketch *sk, const uint8_t *hash)
+{
+	uint64_t v;
+	int lo;
+	int hi;
+	int i;
+
+	v = 0;
+	for (i = 0; i < 8; i++)
+		v = (v << 8) | hash[i];
+
+	if (v >= __atomic_load_n(&sk->thresh, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(&sk->lock);
+
+	lo = 0;
+	hi = sk->num;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (sk->values[mid] < v)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (v < sk->thresh && (lo == sk->num || sk->values[lo] != v)) {
+		if (sk->num < sketch_k)
+			sk->num++;
+
+		memmove(sk->values + lo + 1, sk->values + lo,
+			(sk->num - lo - 1) * sizeof(sk->values[0]));
+		sk->values[lo] = v;
+
+		if (sk->num == sketch_k) {
+			__atomic_store_n(&sk->thresh, sk->values[sketch_k - 1],
+					 __ATOMIC_RELAXED);
+		}
+	}
+
+	pthread_mutex_unlock(&sk->lock);
+}
+
+/*
+ * When hashfrags is run with -l, each line carries the location of
+ * the fragment as "@offset file".  File names are interned, and each
+ * fragment remembers its lowest location in (file name, offset)
+ * order, so that the location reported does not depend on the order
+ * in which the input happened to be processed.
+ */
+struct file_name {
+	struct iv_avl_node	an;
+	struct sketch		**sketches;
+	char			name[];
 };
 
+static pthread_mutex_t file_names_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct iv_avl_tree file_names;
+
+static int
+compare_file_names(const struct iv_avl_node *_a, const struct iv_avl_node *_b)
+{
+	const struct file_name *a;
+	const struct file_name *b;
+
+	a = iv_container_of(_a, struct file_name, an);
+	b = iv_container_of(_b, struct file_name, an);
+
+	return strcmp(a->name, b->name);
+}
+
+static struct file_name *intern_file_name(const char *name)
+{
+	struct iv_avl_node *an;
+	struct file_name *fn;
+
+	pthread_mutex_lock(&file_names_lock);
+
+	an = file_names.root;
+	while (an != NULL) {
+		int ret;
+
+		fn = iv_container_of(an, struct file_name, an);
+
+		ret = strcmp(name, fn->name);
+		if (ret == 0) {
+			pthread_mutex_unlock(&file_names_lock);
+			return fn;
+		}
+
+		if (ret < 0)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	fn = malloc(sizeof(*fn) + strlen(name) + 1);
+	if (fn == NULL) {
+		fprintf(stderr, "out of memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	fn->sketches = NULL;
+	if (sketch_k) {
+		fn->sketches = calloc(MAX_STREAMS, sizeof(*fn->sketches));
+		if (fn->sketches == NULL) {
+			fprintf(stderr, "out of memory!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	strcpy(fn->name, name);
+	iv_avl_tree_insert(&file_names, &fn->an);
+
+	pthread_mutex_unlock(&file_names_lock);
+
+	return fn;
+}
+
+/*
+ * Each source has a separate sketch per stream, as fragments of
+ * different chunking streams of the same data have little to do
+ * with each other.  Sketches are created on first use.
+ */
+static struct sketch *get_sketch(struct file_name *fn, int stream)
+{
+	struct sketch *sk;
+	struct sketch *new;
+
+	sk = __atomic_load_n(&fn->sketches[stream], __ATOMIC_ACQUIRE);
+	if (sk != NULL)
+		return sk;
+
+	new = alloc_sketch();
+	if (__atomic_compare_exchange_n(&fn->sketches[stream], &sk, new, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return new;
+
+	pthread_mutex_destroy(&new->lock);
+	free(new);
+
+	return sk;
+}
+
+static int location_before(const char *file, uint64_t offset,
+			   const struct located_frag *lf)
+{
+	if (file != lf->file)
+		return strcmp(file, lf->file) < 0;
+
+	return offset < lf->offset;
+}
+
+static int compare_frag_keys(const uint8_t *hash, int stream,
+			     const struct frag *f)
+{
+	int ret;
+
+	ret = memcmp(hash, f->hash, sizeof(f->hash));
+	if (ret == 0)
+		ret = (stream > f->stream) - (stream < f->stream);
+
+	return ret;
+}
+
 static int
 compare_frags(const struct iv_avl_node *_a, const struct iv_avl_node *_b)
 {
@@ -39,7 +430,7 @@ compare_frags(const struct iv_avl_node *_a, const struct iv_avl_node *_b)
 	a = iv_container_of(_a, struct frag, an);
 	b = iv_container_of(_b, struct frag, an);
 
-	return memcmp(a->hash, b->hash, sizeof(a->hash));
+	return compare_frag_keys(a->hash, a->stream, b);
 }
 
 static int hextoval(char c)
@@ -78,7 +469,8 @@ static int parse_hash(uint8_t *hash, char *text)
 	return 0;
 }
 
-static struct frag *find_frag(struct iv_avl_tree *frags, const uint8_t *hash)
+static struct frag *find_frag(struct iv_avl_tree *frags, const uint8_t *hash,
+			      int stream)
 {
 	struct iv_avl_node *an;
 
@@ -89,7 +481,7 @@ static struct frag *find_frag(struct iv_avl_tree *frags, const uint8_t *hash)
 
 		f = iv_container_of(an, struct frag, an);
 
-		ret = memcmp(hash, f->hash, sizeof(f->hash));
+		ret = compare_frag_keys(hash, stream, f);
 		if (ret == 0)
 			return f;
 
@@ -104,142 +496,496 @@ static struct frag *find_frag(struct iv_avl_tree *frags, const uint8_t *hash)
 
 static int hash_to_tree(const uint8_t *hash)
 {
-	return (hash[0] << 16) | (hash[1] << 8) | hash[2];
+	uint32_t h;
+
+	h = ((uint32_t)hash[0] << 24) | ((uint32_t)hash[1] << 16) |
+	    ((uint32_t)hash[2] << 8) | hash[3];
+
+	return h >> (32 - tree_bits);
+}
+
+static int tree_to_node(int tree)
+{
+	return ((uint64_t)tree * num_nodes) >> tree_bits;
+}
+
+static int node_first_tree(int node)
+{
+	return ((uint64_t)node * num_trees + num_nodes - 1) / num_nodes;
+}
+
+static pthread_mutex_t *tree_lock(int tree)
+{
+	int node;
+
+	node = 0;
+	if (numa) {
+		node = tree_to_node(tree);
+		tree -= node_first_tree(node);
+	}
+
+	return &tree_locks[node][tree % LOCK_STRIPES];
 }
 
-static void count_frag(const uint8_t *hash, uint64_t length)
+static void count_frag(const uint8_t *hash, int stream, uint64_t length,
+		       const char *file, uint64_t offset)
 {
 	int tree;
+	pthread_mutex_t *lock;
 	struct frag *f;
 
 	tree = hash_to_tree(hash);
-	pthread_mutex_lock(&frags[tree].lock);
+	lock = tree_lock(tree);
+	pthread_mutex_lock(lock);
 
-	f = find_frag(&frags[tree].frags, hash);
+	f = find_frag(&frags[tree], hash, stream);
 	if (f != NULL) {
 		if (length != f->length) {
 			fprintf(stderr, "fragment length mismatch!\n");
 			exit(EXIT_FAILURE);
 		}
 		f->count++;
-		pthread_mutex_unlock(&frags[tree].lock);
+		if (file != NULL && f->has_location) {
+			struct located_frag *lf;
+
+			lf = iv_container_of(f, struct located_frag, f);
+			if (location_before(file, offset, lf)) {
+				lf->file = file;
+				lf->offset = offset;
+			}
+		}
+		pthread_mutex_unlock(lock);
 		return;
 	}
 
-	f = malloc(sizeof(*f));
-	if (f == NULL) {
-		fprintf(stderr, "out of memory!\n");
-		exit(EXIT_FAILURE);
+	if (file != NULL) {
+		struct located_frag *lf;
+
+		lf = alloc_frag(sizeof(*lf));
+		lf->file = file;
+		lf->offset = offset;
+
+		f = &lf->f;
+		f->has_location = 1;
+	} else {
+		f = alloc_frag(sizeof(*f));
+		f->has_location = 0;
 	}
 
 	memcpy(f->hash, hash, sizeof(f->hash));
+	f->stream = stream;
 	f->length = length;
 	f->count = 1;
-	iv_avl_tree_insert(&frags[tree].frags, &f->an);
+	if (frags[tree].compare == NULL)
+		INIT_IV_AVL_TREE(&frags[tree], compare_frags);
+	iv_avl_tree_insert(&frags[tree], &f->an);
 
-	pthread_mutex_unlock(&frags[tree].lock);
+	pthread_mutex_unlock(lock);
 }
 
-static void count_frags(char *buf, size_t len)
-{
-	char *end;
+/*
+ * In NUMA mode, reader threads parse input lines into batches of
+ * records, one batch per node, and hand full batches to the queue of
+ * the node that owns the records' hash prefixes.  Each node has one
+ * inserter thread per CPU, pinned to the node, that takes batches off
+ * its queue and inserts the records into the index.  Queues are
+ * bounded, so that readers can't run arbitrarily far ahead.
+ */
+#define BATCH_RECORDS	1024
+#define MAX_BATCHES	16
+
+struct frag_record {
+	uint8_t		hash[HASH_LENGTH];
+	int		stream;
+	uint64_t	length;
+	const char	*file;
+	uint64_t	offset;
+};
 
-	end = buf + len;
-	while (buf < end) {
-		char *n;
-		char hashstr[256];
-		uint64_t frag_length;
-		uint8_t hash[HASH_LENGTH];
+struct frag_batch {
+	struct iv_list_head	list;
+	int			num;
+	struct frag_record	r[BATCH_RECORDS];
+};
 
-		n = memchr(buf, '\n', end - buf);
-		if (n == NULL) {
-			fprintf(stderr, "no newline found\n");
-			exit(EXIT_FAILURE);
-		}
+struct node_queue {
+	int			node;
+	pthread_mutex_t		lock;
+	pthread_cond_t		not_empty;
+	pthread_cond_t		not_full;
+	struct iv_list_head	batches;
+	int			num_batches;
+	int			done;
+	int			num_workers;
+	pthread_t		*workers;
+};
 
-		*n = 0;
+static struct node_queue node_queues[MAX_NODES];
 
-		if (sscanf(buf, "%255s %" PRId64, hashstr, &frag_length) != 2) {
-			fprintf(stderr, "can't parse line: %s", buf);
-			exit(EXIT_FAILURE);
-		}
+/*
+ * The only uses of libnuma.  When built without it (NUMA=0), -N is
+ * ignored, so these fallbacks are never reached with numa set.
+ */
+#ifdef HAVE_NUMA
+static int node_num_cpus(int node)
+{
+	struct bitmask *cpus;
+	int num;
 
-		if (strlen(hashstr) != 2 * HASH_LENGTH) {
-			fprintf(stderr, "can't parse hash [%s]\n", buf);
-			exit(EXIT_FAILURE);
-		}
+	cpus = numa_allocate_cpumask();
+	num = 0;
+	if (numa_node_to_cpus(node, cpus) == 0)
+		num = numa_bitmask_weight(cpus);
+	numa_free_cpumask(cpus);
 
-		if (parse_hash(hash, hashstr)) {
-			fprintf(stderr, "can't parse hash [%s]\n", hashstr);
-			exit(EXIT_FAILURE);
-		}
+	return num;
+}
 
-		count_frag(hash, frag_length);
+static void node_bind(int node)
+{
+	if (numa_run_on_node(node) < 0)
+		perror("numa_run_on_node");
+}
 
-		buf = (char *)n + 1;
-	}
+static void node_place_memory(void *ptr, size_t size, int node)
+{
+	numa_tonode_memory(ptr, size, node);
 }
 
-struct read_job {
-	int		fd;
+static void *node_alloc(size_t size, int node)
+{
+	return numa_alloc_onnode(size, node);
+}
+#else
+static int node_num_cpus(int node)
+{
+	return 0;
+}
 
-	pthread_mutex_t	lock;
-	const uint8_t	*prev;
-	int		prev_length;
-};
+static void node_bind(int node)
+{
+}
 
-static ssize_t xread(int fd, void *buf, size_t count)
+static void node_place_memory(void *ptr, size_t size, int node)
 {
-	off_t processed;
+}
 
-	processed = 0;
-	while (processed < count) {
-		ssize_t ret;
+static void *node_alloc(size_t size, int node)
+{
+	return malloc(size);
+}
+#endif
 
-		do {
-			ret = read(fd, buf, count - processed);
-		} while (ret < 0 && errno == EINTR);
+static void queue_batch(struct node_queue *nq, struct frag_batch *b)
+{
+	pthread_mutex_lock(&nq->lock);
 
-		if (ret <= 0) {
-			if (ret < 0)
-				perror("read");
-			return processed ? processed : ret;
-		}
+	while (nq->num_batches >= MAX_BATCHES)
+		pthread_cond_wait(&nq->not_full, &nq->lock);
 
-		buf += ret;
-		processed += ret;
-	}
+	iv_list_add_tail(&b->list, &nq->batches);
+	nq->num_batches++;
+	pthread_cond_signal(&nq->not_empty);
 
-	return processed;
+	pthread_mutex_unlock(&nq->lock);
 }
 
-static void *read_thread(void *_me)
+static void route_frag(struct frag_batch **batches, const uint8_t *hash,
+		       int stream, uint64_t length, const char *file,
+		       uint64_t offset)
 {
-	struct worker_thread *me = _me;
-	struct read_job *rj = me->cookie;
-	uint8_t buf[1048576];
-
-	while (1) {
-		size_t len;
-		ssize_t ret;
-		uint8_t *n;
-		size_t nextline;
+	struct frag_batch *b;
+	struct frag_record *r;
+	int node;
 
-		pthread_mutex_lock(&rj->lock);
+	node = tree_to_node(hash_to_tree(hash));
 
-		len = 0;
-		if (rj->prev != NULL) {
-			memmove(buf, rj->prev, rj->prev_length);
-			len = rj->prev_length;
+	b = batches[node];
+	if (b == NULL) {
+		b = malloc(sizeof(*b));
+		if (b == NULL) {
+			fprintf(stderr, "out of memory!\n");
+			exit(EXIT_FAILURE);
 		}
 
-		ret = xread(rj->fd, buf + len, sizeof(buf) - len);
-		if (ret <= 0) {
-			pthread_mutex_unlock(&rj->lock);
-			break;
-		}
+		b->num = 0;
+		batches[node] = b;
+	}
 
-		len += ret;
+	r = &b->r[b->num++];
+	memcpy(r->hash, hash, sizeof(r->hash));
+	r->stream = stream;
+	r->length = length;
+	r->file = file;
+	r->offset = offset;
+
+	if (b->num == BATCH_RECORDS) {
+		queue_batch(&node_queues[node], b);
+		batches[node] = NULL;
+	}
+}
+
+static void *node_worker(void *_nq)
+{
+	struct node_queue *nq = _nq;
+
+	node_bind(nq->node);
+
+	while (1) {
+		struct frag_batch *b;
+		int i;
+
+		pthread_mutex_lock(&nq->lock);
+
+		while (iv_list_empty(&nq->batches) && !nq->done)
+			pthread_cond_wait(&nq->not_empty, &nq->lock);
+
+		if (iv_list_empty(&nq->batches)) {
+			pthread_mutex_unlock(&nq->lock);
+			break;
+		}
+
+		b = iv_container_of(nq->batches.next, struct frag_batch, list);
+		iv_list_del(&b->list);
+		nq->num_batches--;
+		pthread_cond_signal(&nq->not_full);
+
+		pthread_mutex_unlock(&nq->lock);
+
+		for (i = 0; i < b->num; i++) {
+			struct frag_record *r = &b->r[i];
+
+			count_frag(r->hash, r->stream, r->length,
+				   r->file, r->offset);
+		}
+
+		free(b);
+	}
+
+	return NULL;
+}
+
+static void start_node_workers(void)
+{
+	int i;
+
+	for (i = 0; i < num_nodes; i++) {
+		struct node_queue *nq = &node_queues[i];
+		int j;
+
+		pthread_mutex_init(&nq->lock, NULL);
+		pthread_cond_init(&nq->not_empty, NULL);
+		pthread_cond_init(&nq->not_full, NULL);
+		INIT_IV_LIST_HEAD(&nq->batches);
+		nq->num_batches = 0;
+		nq->done = 0;
+
+		nq->num_workers = node_num_cpus(nq->node);
+		if (nq->num_workers == 0)
+			nq->num_workers = 1;
+
+		nq->workers = malloc(nq->num_workers * sizeof(pthread_t));
+		if (nq->workers == NULL) {
+			fprintf(stderr, "out of memory!\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for (j = 0; j < nq->num_workers; j++) {
+			xpthread_create(&nq->workers[j], NULL,
+					node_worker, nq);
+		}
+	}
+}
+
+static void stop_node_workers(void)
+{
+	int i;
+
+	for (i = 0; i < num_nodes; i++) {
+		struct node_queue *nq = &node_queues[i];
+		int j;
+
+		pthread_mutex_lock(&nq->lock);
+		nq->done = 1;
+		pthread_cond_broadcast(&nq->not_empty);
+		pthread_mutex_unlock(&nq->lock);
+
+		for (j = 0; j < nq->num_workers; j++)
+			xpthread_join(nq->workers[j], NULL);
+
+		free(nq->workers);
+	}
+}
+
+static void count_frags(char *buf, size_t len, struct file_name *source)
+{
+	struct frag_batch *batches[MAX_NODES];
+	char last_tag[64];
+	int stream;
+	struct file_name *loc;
+	char *end;
+
+	last_tag[0] = 0;
+	stream = -1;
+	loc = NULL;
+	memset(batches, 0, sizeof(batches));
+
+	end = buf + len;
+	while (buf < end) {
+		char *n;
+		char hashstr[256];
+		char tag[64];
+		uint64_t frag_length;
+		uint8_t hash[HASH_LENGTH];
+		char *p;
+		int pos;
+		const char *file;
+		uint64_t offset;
+
+		n = memchr(buf, '\n', end - buf);
+		if (n == NULL) {
+			fprintf(stderr, "no newline found\n");
+			exit(EXIT_FAILURE);
+		}
+
+		*n = 0;
+
+		if (sscanf(buf, "%255s %" PRId64 " %n", hashstr,
+			   &frag_length, &pos) != 2) {
+			fprintf(stderr, "can't parse line: %s\n", buf);
+			exit(EXIT_FAILURE);
+		}
+		p = buf + pos;
+
+		tag[0] = 0;
+		if (*p && *p != '@') {
+			if (sscanf(p, "%63s %n", tag, &pos) != 1) {
+				fprintf(stderr, "can't parse line: %s\n", buf);
+				exit(EXIT_FAILURE);
+			}
+			p += pos;
+		}
+
+		offset = 0;
+		file = NULL;
+		if (*p == '@') {
+			offset = strtoull(p + 1, &p, 10);
+			if (*p++ != ' ' || !*p) {
+				fprintf(stderr, "can't parse location [%s]\n",
+					buf);
+				exit(EXIT_FAILURE);
+			}
+
+			if (loc == NULL || strcmp(p, loc->name))
+				loc = intern_file_name(p);
+			file = loc->name;
+		} else if (*p) {
+			fprintf(stderr, "can't parse line: %s\n", buf);
+			exit(EXIT_FAILURE);
+		}
+
+		if (strlen(hashstr) != 2 * HASH_LENGTH) {
+			fprintf(stderr, "can't parse hash [%s]\n", buf);
+			exit(EXIT_FAILURE);
+		}
+
+		if (parse_hash(hash, hashstr)) {
+			fprintf(stderr, "can't parse hash [%s]\n", hashstr);
+			exit(EXIT_FAILURE);
+		}
+
+		if (stream < 0 || strcmp(tag, last_tag)) {
+			stream = find_stream(tag);
+			strcpy(last_tag, tag);
+		}
+
+		if (numa) {
+			route_frag(batches, hash, stream, frag_length,
+				   file, offset);
+		} else {
+			count_frag(hash, stream, frag_length, file, offset);
+		}
+
+		if (sketch_k) {
+			struct file_name *fn = (file != NULL) ? loc : source;
+
+			sketch_add(get_sketch(fn, stream), hash);
+		}
+
+		buf = (char *)n + 1;
+	}
+
+	if (numa) {
+		int i;
+
+		for (i = 0; i < num_nodes; i++) {
+			if (batches[i] != NULL)
+				queue_batch(&node_queues[i], batches[i]);
+		}
+	}
+}
+
+struct read_job {
+	int		fd;
+	struct file_name *source;
+
+	pthread_mutex_t	lock;
+	const uint8_t	*prev;
+	int		prev_length;
+};
+
+static ssize_t xread(int fd, void *buf, size_t count)
+{
+	off_t processed;
+
+	processed = 0;
+	while (processed < count) {
+		ssize_t ret;
+
+		do {
+			ret = read(fd, buf, count - processed);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret <= 0) {
+			if (ret < 0)
+				perror("read");
+			return processed ? processed : ret;
+		}
+
+		buf += ret;
+		processed += ret;
+	}
+
+	return processed;
+}
+
+static void *read_thread(void *_me)
+{
+	struct worker_thread *me = _me;
+	struct read_job *rj = me->cookie;
+	uint8_t buf[1048576];
+
+	while (1) {
+		size_t len;
+		ssize_t ret;
+		uint8_t *n;
+		size_t nextline;
+
+		pthread_mutex_lock(&rj->lock);
+
+		len = 0;
+		if (rj->prev != NULL) {
+			memmove(buf, rj->prev, rj->prev_length);
+			len = rj->prev_length;
+		}
+
+		ret = xread(rj->fd, buf + len, sizeof(buf) - len);
+		if (ret <= 0) {
+			pthread_mutex_unlock(&rj->lock);
+			break;
+		}
+
+		len += ret;
 
 		n = memrchr(buf, '\n', len);
 		if (n == NULL) {
@@ -258,17 +1004,18 @@ static void *read_thread(void *_me)
 
 		pthread_mutex_unlock(&rj->lock);
 
-		count_frags((char *)buf, len);
+		count_frags((char *)buf, len, rj->source);
 	}
 
 	return NULL;
 }
 
-static void read_frags(int fd)
+static void read_frags(int fd, const char *name)
 {
 	struct read_job rj;
 
 	rj.fd = fd;
+	rj.source = sketch_k ? intern_file_name(name) : NULL;
 	pthread_mutex_init(&rj.lock, NULL);
 	rj.prev = NULL;
 	rj.prev_length = 0;
@@ -277,114 +1024,912 @@ static void read_frags(int fd)
 	pthread_mutex_destroy(&rj.lock);
 }
 
-struct summarize_job {
-	int		tree;
-
-	pthread_mutex_t	lock;
+/*
+ * Besides the totals, the summary pass computes the totals with
+ * fragment lengths rounded up to each of round_sizes[] (to estimate
+ * the space needed to store fragments on file systems with those
+ * block sizes), a histogram of unique fragments by log2 of their
+ * length, and a histogram of unique fragments by log2 of the number
+ * of times they occur.  The "bytes in pages" figures are the totals
+ * for round_sizes[PAGE_ROUND].
+ */
+static const uint64_t round_sizes[] = { 512, 4096, 65536, 1048576 };
+static const char *round_names[] = { "512", "4K", "64K", "1M" };
+
+#define NUM_ROUND_SIZES	(sizeof(round_sizes) / sizeof(round_sizes[0]))
+#define PAGE_ROUND	1
+
+#define SIZE_BUCKETS	65
+#define DUP_BUCKETS	32
+
+struct stream_summary {
 	uint64_t	frag_count;
 	uint64_t	unique_frag_count;
 	uint64_t	bytes;
 	uint64_t	unique_bytes;
-	uint64_t	pagebytes;
-	uint64_t	unique_pagebytes;
+	uint64_t	rounded[NUM_ROUND_SIZES];
+	uint64_t	unique_rounded[NUM_ROUND_SIZES];
+	uint64_t	size_hist[SIZE_BUCKETS];
+	uint64_t	dup_hist[DUP_BUCKETS];
+};
+
+/*
+ * With -n N, the summary pass also finds, for each stream, the N
+ * duplicated fragments that account for the most redundant bytes,
+ * i.e. (count - 1) * length, and the N most frequently occurring
+ * fragments.  Each thread keeps bounded min-heaps of its candidates,
+ * which are merged into the final heaps during the reduction.
+ */
+enum {
+	TOP_BYTES,
+	TOP_COUNT,
+	NUM_TOP,
+};
+
+static int top_n;
+
+struct frag_heap {
+	int		num;
+	struct frag	**f;
 };
 
+static uint64_t top_key(const struct frag *f, int which)
+{
+	if (which == TOP_BYTES)
+		return (f->count - 1) * f->length;
+
+	return f->count;
+}
+
+/*
+ * Ties are broken on the hash, so that the report does not depend
+ * on the order in which fragments were visited.
+ */
+static int compare_top(const struct frag *a, const struct frag *b, int which)
+{
+	uint64_t ka;
+	uint64_t kb;
+
+	ka = top_key(a, which);
+	kb = top_key(b, which);
+	if (ka != kb)
+		return (ka > kb) ? 1 : -1;
+
+	return memcmp(b->hash, a->hash, sizeof(a->hash));
+}
+
+static void heap_add(struct frag_heap *h, int which, struct frag *f)
+{
+	int i;
+
+	if (h->f == NULL) {
+		h->f = malloc(top_n * sizeof(*h->f));
+		if (h->f == NULL) {
+			fprintf(stderr, "out of memory!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (h->num < top_n) {
+		i = h->num++;
+		while (i) {
+			int parent = (i - 1) / 2;
+
+			if (compare_top(f, h->f[parent], which) >= 0)
+				break;
+
+			h->f[i] = h->f[parent];
+			i = parent;
+		}
+		h->f[i] = f;
+
+		return;
+	}
+
+	if (compare_top(f, h->f[0], which) <= 0)
+		return;
+
+	i = 0;
+	while (1) {
+		int child = 2 * i + 1;
+
+		if (child >= h->num)
+			break;
+
+		if (child + 1 < h->num &&
+		    compare_top(h->f[child + 1], h->f[child], which) < 0)
+			child++;
+
+		if (compare_top(f, h->f[child], which) <= 0)
+			break;
+
+		h->f[i] = h->f[child];
+		i = child;
+	}
+	h->f[i] = f;
+}
+
+/*
+ * Each summarize thread accumulates into its own summary_acc, with
+ * no locking while it walks the trees.  Threads claim ranges of
+ * SUMMARIZE_CHUNK trees at a time, and when they run out of ranges
+ * they push their accumulator onto a list, which is reduced once all
+ * threads have finished.
+ */
+#define SUMMARIZE_CHUNK	65536
+
+struct summary_acc {
+	struct summary_acc	*next;
+	struct stream_summary	s[MAX_STREAMS];
+	struct frag_heap	top[MAX_STREAMS][NUM_TOP];
+};
+
+struct summarize_job {
+	int			next_tree;
+	struct summary_acc	*accs;
+};
+
+static int log2_bucket(uint64_t x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static void summarize_frag(struct stream_summary *ss, const struct frag *f)
+{
+	int i;
+
+	ss->frag_count += f->count;
+	ss->unique_frag_count++;
+
+	ss->bytes += f->count * f->length;
+	ss->unique_bytes += f->length;
+
+	for (i = 0; i < NUM_ROUND_SIZES; i++) {
+		uint64_t rb;
+
+		rb = ROUND_UP(f->length, round_sizes[i]);
+		ss->rounded[i] += f->count * rb;
+		ss->unique_rounded[i] += rb;
+	}
+
+	ss->size_hist[log2_bucket(f->length)]++;
+	ss->dup_hist[log2_bucket(f->count) - 1]++;
+}
+
 static void *summarize_thread(void *_me)
 {
 	struct worker_thread *me = _me;
 	struct summarize_job *sj = me->cookie;
+	struct summary_acc *acc;
 
-	pthread_mutex_lock(&sj->lock);
+	acc = calloc(1, sizeof(*acc));
+	if (acc == NULL) {
+		fprintf(stderr, "out of memory!\n");
+		exit(EXIT_FAILURE);
+	}
 
 	while (1) {
+		int start;
 		int i;
-		uint64_t frag_count;
-		uint64_t unique_frag_count;
-		uint64_t bytes;
-		uint64_t unique_bytes;
-		uint64_t pagebytes;
-		uint64_t unique_pagebytes;
-		struct iv_avl_node *an;
-
-		i = sj->tree;
-		if (i == TREES)
+
+		start = __atomic_fetch_add(&sj->next_tree, SUMMARIZE_CHUNK,
+					   __ATOMIC_RELAXED);
+		if (start >= num_trees)
 			break;
 
-		sj->tree++;
+		for (i = start; i < start + SUMMARIZE_CHUNK &&
+		     i < num_trees; i++) {
+			struct iv_avl_node *an;
+
+			iv_avl_tree_for_each (an, &frags[i]) {
+				struct frag *f;
 
-		pthread_mutex_unlock(&sj->lock);
+				f = iv_container_of(an, struct frag, an);
+				summarize_frag(&acc->s[f->stream], f);
 
-		frag_count = 0;
-		unique_frag_count = 0;
-		bytes = 0;
-		unique_bytes = 0;
-		pagebytes = 0;
-		unique_pagebytes = 0;
+				if (top_n && f->count > 1) {
+					struct frag_heap *h;
+
+					h = acc->top[f->stream];
+					heap_add(&h[TOP_BYTES], TOP_BYTES, f);
+					heap_add(&h[TOP_COUNT], TOP_COUNT, f);
+				}
+			}
+		}
+	}
 
-		iv_avl_tree_for_each (an, &frags[i].frags) {
-			struct frag *f;
-			uint64_t pb;
+	acc->next = __atomic_load_n(&sj->accs, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&sj->accs, &acc->next, acc, 1,
+					    __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
 
-			f = iv_container_of(an, struct frag, an);
+	return NULL;
+}
 
-			pb = ROUND_UP(f->length, 4096);
+/*
+ * struct stream_summary consists of uint64_t counters only, so the
+ * reduction can simply add them up as arrays.
+ */
+#define SUMMARY_WORDS	(sizeof(struct stream_summary) / sizeof(uint64_t))
 
-			frag_count += f->count;
-			unique_frag_count++;
+static void summarize(struct stream_summary *s,
+		      struct frag_heap top[][NUM_TOP])
+{
+	struct summarize_job sj;
+	struct summary_acc *acc;
+
+	sj.next_tree = 0;
+	sj.accs = NULL;
+	run_threads(summarize_thread, &sj);
+
+	memset(s, 0, MAX_STREAMS * sizeof(*s));
+	memset(top, 0, MAX_STREAMS * sizeof(*top));
+
+	acc = sj.accs;
+	while (acc != NULL) {
+		struct summary_acc *next;
+		int i;
 
-			bytes += f->count * f->length;
-			unique_bytes += f->length;
+		for (i = 0; i < num_streams; i++) {
+			uint64_t *dst = (uint64_t *)&s[i];
+			const uint64_t *src = (const uint64_t *)&acc->s[i];
+			int j;
 
-			pagebytes += f->count * pb;
-			unique_pagebytes += pb;
+			for (j = 0; j < SUMMARY_WORDS; j++)
+				dst[j] += src[j];
+
+			for (j = 0; j < NUM_TOP; j++) {
+				struct frag_heap *h = &acc->top[i][j];
+				int k;
+
+				for (k = 0; k < h->num; k++)
+					heap_add(&top[i][j], j, h->f[k]);
+				free(h->f);
+			}
 		}
 
-		pthread_mutex_lock(&sj->lock);
+		next = acc->next;
+		free(acc);
+		acc = next;
+	}
+}
+
+/*
+ * Columns are printed in version sort order of the stream names, so
+ * that e.g. b4096 comes before b65536 regardless of the order in
+ * which the streams were first seen.
+ */
+static int stream_order[MAX_STREAMS];
+
+static int compare_stream_order(const void *_a, const void *_b)
+{
+	const int *a = _a;
+	const int *b = _b;
+
+	return strverscmp(stream_names[*a], stream_names[*b]);
+}
+
+#define LABEL_WIDTH	32
+
+static uint64_t field_value(const struct stream_summary *s, int stream,
+			    size_t field)
+{
+	return *(const uint64_t *)((const char *)&s[stream] + field);
+}
 
-		sj->frag_count += frag_count;
-		sj->unique_frag_count += unique_frag_count;
-		sj->bytes += bytes;
-		sj->unique_bytes += unique_bytes;
-		sj->pagebytes += pagebytes;
-		sj->unique_pagebytes += unique_pagebytes;
+static void print_header(const char *title)
+{
+	int i;
+
+	printf("%-*s", LABEL_WIDTH, title);
+	for (i = 0; i < num_streams; i++) {
+		const char *name = stream_names[stream_order[i]];
+
+		printf(" %15s", name[0] ? name : "-");
 	}
+	printf("\n");
+}
+
+static void print_row(const char *name, const struct stream_summary *s,
+		      size_t field)
+{
+	int i;
 
-	pthread_mutex_unlock(&sj->lock);
+	printf("%-*s", LABEL_WIDTH, name);
+	for (i = 0; i < num_streams; i++)
+		printf(" %15" PRId64, field_value(s, stream_order[i], field));
+	printf("\n");
+}
 
-	return NULL;
+static void print_ratio_row(const char *name, const struct stream_summary *s,
+			    size_t num_field, size_t denom_field)
+{
+	int i;
+
+	printf("%-*s", LABEL_WIDTH, name);
+	for (i = 0; i < num_streams; i++) {
+		uint64_t num;
+		uint64_t denom;
+
+		num = field_value(s, stream_order[i], num_field);
+		denom = field_value(s, stream_order[i], denom_field);
+		printf(" %15.3f", denom ? (double)num / denom : 0.0);
+	}
+	printf("\n");
+}
+
+#define FIELD(f)	offsetof(struct stream_summary, f)
+#define ARRAY_FIELD(f, i)	(FIELD(f) + (i) * sizeof(uint64_t))
+
+static void print_totals(const struct stream_summary *s)
+{
+	print_header("");
+	print_row("fragments (total)", s, FIELD(frag_count));
+	print_row("fragments (unique)", s, FIELD(unique_frag_count));
+	print_row("bytes (total)", s, FIELD(bytes));
+	print_row("bytes (unique)", s, FIELD(unique_bytes));
+	print_ratio_row("fragment size (avg)", s,
+			FIELD(bytes), FIELD(frag_count));
+	print_ratio_row("dedup ratio", s, FIELD(bytes), FIELD(unique_bytes));
+}
+
+static void print_rounded(const struct stream_summary *s)
+{
+	int i;
+
+	print_header("rounded to block size");
+	for (i = 0; i < NUM_ROUND_SIZES; i++) {
+		char name[LABEL_WIDTH + 1];
+
+		snprintf(name, sizeof(name), "bytes in %s blocks (total)",
+			 round_names[i]);
+		print_row(name, s, ARRAY_FIELD(rounded, i));
+
+		snprintf(name, sizeof(name), "bytes in %s blocks (unique)",
+			 round_names[i]);
+		print_row(name, s, ARRAY_FIELD(unique_rounded, i));
+
+		snprintf(name, sizeof(name), "dedup ratio (%s blocks)",
+			 round_names[i]);
+		print_ratio_row(name, s, ARRAY_FIELD(rounded, i),
+				ARRAY_FIELD(unique_rounded, i));
+	}
+}
+
+/*
+ * Bucket b of a histogram counts values in [2^(b-1+shift),
+ * 2^(b+shift)), with bucket 0 of the size histogram counting
+ * zero-length fragments.  Only buckets that are nonzero for at least
+ * one stream are printed.
+ */
+static void print_hist(const char *title, const struct stream_summary *s,
+		       size_t field, int buckets, int shift)
+{
+	int b;
+
+	print_header(title);
+	for (b = 0; b < buckets; b++) {
+		char name[64];
+		uint64_t lo;
+		int i;
+
+		for (i = 0; i < num_streams; i++) {
+			if (field_value(s, i, field + b * sizeof(uint64_t)))
+				break;
+		}
+		if (i == num_streams)
+			continue;
+
+		lo = (b + shift) ? 1ULL << (b + shift - 1) : 0;
+		if (b + shift < 64) {
+			snprintf(name, sizeof(name), "%" PRIu64 " - %" PRIu64,
+				 lo, (uint64_t)(1ULL << (b + shift)) - 1);
+		} else {
+			snprintf(name, sizeof(name), "%" PRIu64 " -", lo);
+		}
+
+		print_row(name, s, field + b * sizeof(uint64_t));
+	}
+}
+
+static int compare_top_bytes(const void *_a, const void *_b)
+{
+	struct frag * const *a = _a;
+	struct frag * const *b = _b;
+
+	return compare_top(*b, *a, TOP_BYTES);
+}
+
+static int compare_top_count(const void *_a, const void *_b)
+{
+	struct frag * const *a = _a;
+	struct frag * const *b = _b;
+
+	return compare_top(*b, *a, TOP_COUNT);
+}
+
+static void print_top(struct frag_heap top[][NUM_TOP])
+{
+	static const char *titles[] = { "redundant bytes", "count" };
+	int i;
+
+	for (i = 0; i < num_streams; i++) {
+		int stream = stream_order[i];
+		int which;
+
+		for (which = 0; which < NUM_TOP; which++) {
+			struct frag_heap *h = &top[stream][which];
+			int j;
+
+			if (h->num == 0)
+				continue;
+
+			qsort(h->f, h->num, sizeof(*h->f),
+			      (which == TOP_BYTES) ? compare_top_bytes :
+						     compare_top_count);
+
+			printf("\ntop %d fragments by %s", h->num,
+			       titles[which]);
+			if (stream_names[stream][0])
+				printf(" (%s)", stream_names[stream]);
+			printf("\n");
+
+			printf("%10s %15s %15s hash [location]\n",
+			       "count", "length", "redundant");
+
+			for (j = 0; j < h->num; j++) {
+				const struct frag *f = h->f[j];
+				int k;
+
+				printf("%10d %15" PRIu64 " %15" PRIu64 " ",
+				       f->count, f->length,
+				       top_key(f, TOP_BYTES));
+				for (k = 0; k < sizeof(f->hash); k++)
+					printf("%02x", f->hash[k]);
+				if (f->has_location) {
+					const struct located_frag *lf;
+
+					lf = iv_container_of(f,
+						struct located_frag, f);
+					printf(" @%" PRIu64 " %s",
+					       lf->offset, lf->file);
+				}
+				printf("\n");
+			}
+
+			free(h->f);
+		}
+	}
 }
 
 static void print_summary(void)
 {
-	struct summarize_job sj;
+	struct stream_summary s[MAX_STREAMS];
+	struct frag_heap top[MAX_STREAMS][NUM_TOP];
+	struct stream_summary *ss;
+	int i;
 
-	memset(&sj, 0, sizeof(sj));
-	pthread_mutex_init(&sj.lock, NULL);
-	run_threads(summarize_thread, &sj);
+	summarize(s, top);
+
+	for (i = 0; i < num_streams; i++)
+		stream_order[i] = i;
+	qsort(stream_order, num_streams, sizeof(stream_order[0]),
+	      compare_stream_order);
+
+	/*
+	 * With several streams, print one column per stream, so that
+	 * e.g. different chunking thresholds, or content defined
+	 * chunking and fixed-size blocks, can be compared directly.
+	 * With a single untagged stream, start with the traditional
+	 * six totals.
+	 */
+	if (num_streams > 1 ||
+	    (num_streams == 1 && stream_names[0][0])) {
+		print_totals(s);
+	} else {
+		ss = &s[0];
+		printf("fragments (total)\t%15" PRId64 "\n",
+		       ss->frag_count);
+		printf("fragments (unique)\t%15" PRId64 "\n",
+		       ss->unique_frag_count);
+		printf("bytes (total)\t\t%15" PRId64 "\n", ss->bytes);
+		printf("bytes (unique)\t\t%15" PRId64 "\n", ss->unique_bytes);
+		printf("bytes in pages (total)\t%15" PRId64 "\n",
+		       ss->rounded[PAGE_ROUND]);
+		printf("bytes in pages (unique)\t%15" PRId64 "\n",
+		       ss->unique_rounded[PAGE_ROUND]);
+	}
+
+	if (num_streams == 0)
+		return;
+
+	printf("\n");
+	print_rounded(s);
+
+	printf("\n");
+	print_hist("fragment size (unique)", s, FIELD(size_hist),
+		   SIZE_BUCKETS, 0);
+
+	printf("\n");
+	print_hist("fragment count (unique)", s, FIELD(dup_hist),
+		   DUP_BUCKETS, 1);
+
+	print_top(top);
+}
+
+/*
+ * The Jaccard index of two sets is estimated as the fraction of the
+ * k smallest values of the union of their sketches that is present
+ * in both sketches.  All of those values are below the thresholds of
+ * both sketches, so membership in each set is known exactly.
+ */
+static double sketch_jaccard(const struct sketch *a, const struct sketch *b)
+{
+	int i;
+	int j;
+	int n;
+	int both;
+
+	i = 0;
+	j = 0;
+	n = 0;
+	both = 0;
+	while (n < sketch_k && (i < a->num || j < b->num)) {
+		uint64_t va = (i < a->num) ? a->values[i] : UINT64_MAX;
+		uint64_t vb = (j < b->num) ? b->values[j] : UINT64_MAX;
+
+		if (j == b->num || (i < a->num && va < vb)) {
+			i++;
+		} else if (i == a->num || vb < va) {
+			j++;
+		} else {
+			both++;
+			i++;
+			j++;
+		}
+		n++;
+	}
+
+	return n ? (double)both / n : 0.0;
+}
 
-	pthread_mutex_destroy(&sj.lock);
+static double sketch_cardinality(const struct sketch *sk)
+{
+	if (sk->num < sketch_k)
+		return sk->num;
 
-	printf("fragments (total)\t%15" PRId64 "\n", sj.frag_count);
-	printf("fragments (unique)\t%15" PRId64 "\n", sj.unique_frag_count);
-	printf("bytes (total)\t\t%15" PRId64 "\n", sj.bytes);
-	printf("bytes (unique)\t\t%15" PRId64 "\n", sj.unique_bytes);
-	printf("bytes in pages (total)\t%15" PRId64 "\n", sj.pagebytes);
-	printf("bytes in pages (unique)\t%15" PRId64 "\n", sj.unique_pagebytes);
+	return (sketch_k - 1) / ((double)sk->values[sketch_k - 1] / 0x1p64);
+}
+
+struct similarity_job {
+	int			stream;
+	int			num_files;
+	struct file_name	**files;
+	int			next_row;
+	char			**rows;
+	size_t			*row_lengths;
+};
+
+static void *similarity_thread(void *_me)
+{
+	struct worker_thread *me = _me;
+	struct similarity_job *sj = me->cookie;
+
+	while (1) {
+		struct sketch *a;
+		double ca;
+		FILE *fp;
+		int i;
+		int j;
+
+		i = __atomic_fetch_add(&sj->next_row, 1, __ATOMIC_RELAXED);
+		if (i >= sj->num_files)
+			break;
+
+		fp = open_memstream(&sj->rows[i], &sj->row_lengths[i]);
+		if (fp == NULL) {
+			perror("open_memstream");
+			exit(EXIT_FAILURE);
+		}
+
+		a = sj->files[i]->sketches[sj->stream];
+		ca = sketch_cardinality(a);
+
+		for (j = i + 1; j < sj->num_files; j++) {
+			struct sketch *b = sj->files[j]->sketches[sj->stream];
+			double jac;
+			double cb;
+			double common;
+
+			jac = sketch_jaccard(a, b);
+			if (jac == 0 || jac < min_similarity)
+				continue;
+
+			cb = sketch_cardinality(b);
+			common = jac * (ca + cb) / (1 + jac);
+
+			fprintf(fp, "%s\t%.4f\t%.4f\t%.4f\t%s\t%s\n",
+				stream_names[sj->stream][0] ?
+				stream_names[sj->stream] : "-", jac,
+				(common < ca) ? common / ca : 1.0,
+				(common < cb) ? common / cb : 1.0,
+				sj->files[i]->name, sj->files[j]->name);
+		}
+
+		fclose(fp);
+	}
+
+	return NULL;
+}
+
+static int has_sketch(const struct file_name *fn, int stream)
+{
+	return fn->sketches[stream] != NULL && fn->sketches[stream]->num;
+}
+
+static void print_stream_similarity(int stream)
+{
+	struct similarity_job sj;
+	struct iv_avl_node *an;
+	int i;
+
+	sj.stream = stream;
+	sj.num_files = 0;
+	iv_avl_tree_for_each (an, &file_names) {
+		struct file_name *fn;
+
+		fn = iv_container_of(an, struct file_name, an);
+		if (has_sketch(fn, stream))
+			sj.num_files++;
+	}
+
+	if (sj.num_files < 2)
+		return;
+
+	sj.files = malloc(sj.num_files * sizeof(*sj.files));
+	sj.rows = calloc(sj.num_files, sizeof(*sj.rows));
+	sj.row_lengths = calloc(sj.num_files, sizeof(*sj.row_lengths));
+	if (sj.files == NULL || sj.rows == NULL || sj.row_lengths == NULL) {
+		fprintf(stderr, "out of memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	i = 0;
+	iv_avl_tree_for_each (an, &file_names) {
+		struct file_name *fn;
+
+		fn = iv_container_of(an, struct file_name, an);
+		if (has_sketch(fn, stream))
+			sj.files[i++] = fn;
+	}
+
+	sj.next_row = 0;
+	run_threads(similarity_thread, &sj);
+
+	for (i = 0; i < sj.num_files; i++) {
+		fwrite(sj.rows[i], sj.row_lengths[i], 1, stdout);
+		free(sj.rows[i]);
+	}
+
+	free(sj.row_lengths);
+	free(sj.rows);
+	free(sj.files);
+}
+
+/*
+ * Print, for every stream and every pair of sources that have any
+ * fragments of that stream in common (or at least min_similarity, if
+ * given), the estimated Jaccard index and the estimated fraction of
+ * each source that is contained in the other.  Rows of the (upper
+ * triangular) matrix are computed in parallel, and only the sketches
+ * are kept in memory, not the full per-source fragment sets.
+ */
+static void print_similarity(void)
+{
+	int i;
+
+	printf("\nstream\tjaccard\ta_in_b\tb_in_a\ta\tb\n");
+	for (i = 0; i < num_streams; i++)
+		print_stream_similarity(stream_order[i]);
+}
+
+/*
+ * Estimate an upper bound on the number of input lines from the
+ * sizes of the input files.  If any of them is not a regular file,
+ * we can't tell, and assume the worst.
+ */
+static uint64_t estimate_lines(int num, char **files)
+{
+	uint64_t bytes;
+	int i;
+
+	if (num == 0) {
+		struct stat buf;
+
+		if (fstat(0, &buf) < 0 || !S_ISREG(buf.st_mode))
+			return UINT64_MAX;
+
+		return buf.st_size / MIN_LINE_LENGTH;
+	}
+
+	bytes = 0;
+	for (i = 0; i < num; i++) {
+		struct stat buf;
+
+		if (stat(files[i], &buf) < 0 || !S_ISREG(buf.st_mode))
+			return UINT64_MAX;
+
+		bytes += buf.st_size;
+	}
+
+	return bytes / MIN_LINE_LENGTH;
+}
+
+static void init_frags(uint64_t lines)
+{
+	int i;
+
+	tree_bits = MIN_TREE_BITS;
+	while (tree_bits < MAX_TREE_BITS &&
+	       (lines / FRAGS_PER_TREE) >> tree_bits)
+		tree_bits++;
+
+	num_trees = 1 << tree_bits;
+
+	frags = alloc_index_mem(num_trees * sizeof(*frags));
+
+	/*
+	 * Place each node's range of the tree array on that node.
+	 * Ranges are rounded to whole pages, so with small arrays,
+	 * a node's range can end up placed on a neighbouring node.
+	 */
+	for (i = 0; numa && i < num_nodes; i++) {
+		uint64_t start;
+		uint64_t end;
+
+		start = ROUND_UP(node_first_tree(i) * sizeof(*frags),
+				 index_page_size);
+		end = ROUND_UP(node_first_tree(i + 1) * sizeof(*frags),
+			       index_page_size);
+		if (start < end) {
+			node_place_memory((uint8_t *)frags + start,
+					  end - start, node_queues[i].node);
+		}
+	}
+
+	for (i = 0; i < (numa ? num_nodes : 1); i++) {
+		size_t size = LOCK_STRIPES * sizeof(pthread_mutex_t);
+		pthread_mutex_t *locks;
+		int j;
+
+		if (numa)
+			locks = node_alloc(size, node_queues[i].node);
+		else
+			locks = malloc(size);
+		if (locks == NULL) {
+			fprintf(stderr, "out of memory!\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for (j = 0; j < LOCK_STRIPES; j++)
+			pthread_mutex_init(&locks[j], NULL);
+
+		tree_locks[i] = locks;
+	}
+}
+
+static void parse_huge_pages(const char *arg)
+{
+	if (!strcmp(arg, "thp")) {
+		use_thp = 1;
+		index_page_size = 2 << 20;
+	} else if (!strcasecmp(arg, "2M")) {
+		hugetlb_flags = MAP_HUGETLB | (21 << MAP_HUGE_SHIFT);
+		index_page_size = 2 << 20;
+	} else if (!strcasecmp(arg, "1G")) {
+		hugetlb_flags = MAP_HUGETLB | (30 << MAP_HUGE_SHIFT);
+		index_page_size = 1 << 30;
+	} else {
+		fprintf(stderr, "invalid huge page size: %s\n", arg);
+		exit(EXIT_FAILURE);
+	}
+
+	use_arenas = 1;
+}
+
+#ifdef HAVE_NUMA
+static void init_numa(void)
+{
+	int max;
+	int i;
+
+	if (numa_available() < 0) {
+		fprintf(stderr, "NUMA not available, ignoring -N\n");
+		numa = 0;
+		return;
+	}
+
+	max = numa_max_node();
+	for (i = 0; i <= max && num_nodes < MAX_NODES; i++) {
+		if (numa_bitmask_isbitset(numa_all_nodes_ptr, i))
+			node_queues[num_nodes++].node = i;
+	}
+
+	use_arenas = 1;
+}
+#else
+static void init_numa(void)
+{
+	fprintf(stderr, "built without NUMA support, ignoring -N\n");
+	numa = 0;
+}
+#endif
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "syntax: %s [-n top] [-s k [-m min]] "
+			"[-H thp|2M|1G] [-N] [<file>+]\n", progname);
 }
 
 int main(int argc, char *argv[])
 {
+	char *end;
+	long val;
+	int opt;
 	int i;
 
-	for (i = 0; i < TREES; i++) {
-		INIT_IV_AVL_TREE(&frags[i].frags, compare_frags);
-		pthread_mutex_init(&frags[i].lock, NULL);
+	while ((opt = getopt(argc, argv, "H:Nm:n:s:")) != -1) {
+		switch (opt) {
+		case 'H':
+			parse_huge_pages(optarg);
+			break;
+		case 'N':
+			numa = 1;
+			break;
+		case 'm':
+			min_similarity = strtod(optarg, &end);
+			if (end == optarg || *end || !(min_similarity >= 0) ||
+			    min_similarity > 1) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'n':
+			val = strtol(optarg, &end, 10);
+			if (end == optarg || *end || val < 0 || val > INT_MAX) {
+				usage(argv[0]);
+				return 1;
+			}
+			top_n = val;
+			break;
+		case 's':
+			val = strtol(optarg, &end, 10);
+			if (end == optarg || *end || val <= 0 ||
+			    val > INT_MAX) {
+				usage(argv[0]);
+				return 1;
+			}
+			sketch_k = val;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
 	}
 
-	if (argc > 1) {
-		int i;
+	INIT_IV_AVL_TREE(&file_names, compare_file_names);
+
+	if (numa)
+		init_numa();
+
+	init_frags(estimate_lines(argc - optind, argv + optind));
 
-		for (i = 1; i < argc; i++) {
+	if (numa)
+		start_node_workers();
+
+	if (optind < argc) {
+		for (i = optind; i < argc; i++) {
 			int fd;
 
 			fd = open(argv[i], O_RDONLY);
@@ -393,15 +1938,21 @@ int main(int argc, char *argv[])
 				return 1;
 			}
 
-			read_frags(fd);
+			read_frags(fd, argv[i]);
 
 			close(fd);
 		}
 	} else {
-		read_frags(0);
+		read_frags(0, "-");
 	}
 
+	if (numa)
+		stop_node_workers();
+
 	print_summary();
 
+	if (sketch_k)
+		print_similarity();
+
 	return 0;
 }
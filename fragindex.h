@@ -0,0 +1,28 @@
+#ifndef __FRAGINDEX_H
+#define __FRAGINDEX_H
+
+#include <stdint.h>
+
+/*
+ * A fragment index can be stored alongside the offset-named fragments
+ * in a fragment directory, to save splitfs from having to enumerate
+ * and stat every fragment.  It consists of a fixed header followed by
+ * num_entries entries sorted by start offset, all in host byte order.
+ * It is only trusted if it is at least as new as its directory.
+ */
+#define FRAGINDEX_NAME		"index"
+#define FRAGINDEX_MAGIC		"fasdup index 1\n"
+
+struct fragindex_header {
+	char		magic[16];
+	uint64_t	num_entries;
+	uint64_t	file_size;
+};
+
+struct fragindex_entry {
+	uint64_t	start;
+	uint64_t	end;
+};
+
+
+#endif
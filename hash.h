@@ -2,6 +2,7 @@
 #define __HASH_H
 
 #include <openssl/sha.h>
+#include "sha512_mb.h"
 
 #define HASH_LENGTH	SHA512_DIGEST_LENGTH
 
@@ -10,5 +11,14 @@ static inline void hashfn(const unsigned char *d, size_t n, unsigned char *md)
 	SHA512(d, n, md);
 }
 
+/*
+ * Hash a batch of independent buffers, several at a time where the
+ * CPU allows.  Each job's digest is HASH_LENGTH bytes long.
+ */
+static inline void hashfn_batch(struct sha512_mb_job *jobs, int num)
+{
+	sha512_mb(jobs, num);
+}
+
 
 #endif
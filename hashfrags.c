@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <pthread.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -11,6 +12,25 @@
 #include "hash.h"
 #include "splitpoints.h"
 
+/*
+ * With -t, fragments are computed for each of the given thresholds
+ * in a single pass, and with -b, the file is additionally cut into
+ * fixed-size blocks of each of the given sizes in that same pass.
+ * Each output line is then tagged with the stream it belongs to, for
+ * countfrags to tell them apart.
+ */
+static int num_streams;
+static int num_crc_streams;
+static struct split_level streams[SPLIT_MAX_LEVELS];
+static char stream_tag[SPLIT_MAX_LEVELS][32];
+
+/*
+ * With -l, each output line ends with the offset and the name of the
+ * file that the fragment was found in, as "@offset file".
+ */
+static int locations;
+static const char *cur_file;
+
 static char hexnibble(int n)
 {
 	if (n < 10)
@@ -19,44 +39,87 @@ static char hexnibble(int n)
 		return 'a' + (n - 10);
 }
 
-static void split(FILE *fp, int fd, uint64_t from, uint64_t to)
+static void print_frag(FILE *fp, const uint8_t *hash, uint64_t from,
+		       uint64_t length, const char *tag)
 {
-	uint64_t length;
-	uint8_t *buf;
-	unsigned char hash[HASH_LENGTH];
 	int len;
 	int i;
 	char pbuf[256];
 
-	length = to - from;
+	len = 0;
+	for (i = 0; i < HASH_LENGTH; i++) {
+		pbuf[len++] = hexnibble(hash[i] >> 4);
+		pbuf[len++] = hexnibble(hash[i] & 0xf);
+	}
+	len += sprintf(pbuf + len, " %" PRId64, length);
+	if (tag != NULL)
+		len += sprintf(pbuf + len, " %s", tag);
+
+	fwrite(pbuf, len, 1, fp);
+
+	if (locations)
+		fprintf(fp, " @%" PRId64 " %s", from, cur_file);
+	fputc('\n', fp);
+}
+
+/*
+ * Fragments are hashed in batches of up to HASH_BATCH consecutive
+ * fragments, which are read in with a single pread() and then hashed
+ * side by side by the multi-buffer hash implementation.  A batch is
+ * cut short when it would exceed HASH_BATCH_BYTES, unless it would
+ * then be empty.
+ */
+#define HASH_BATCH		16
+#define HASH_BATCH_BYTES	(64 << 20)
+
+static int split_batch(FILE *fp, int fd, int num, uint64_t *split_offsets,
+		       const char *tag)
+{
+	struct sha512_mb_job jobs[HASH_BATCH];
+	uint8_t hash[HASH_BATCH][HASH_LENGTH];
+	uint64_t length;
+	uint8_t *buf;
+	int n;
+	int i;
+
+	for (n = 1; n < HASH_BATCH && n < num; n++) {
+		if (split_offsets[n + 1] - split_offsets[0] > HASH_BATCH_BYTES)
+			break;
+	}
+
+	length = split_offsets[n] - split_offsets[0];
 	if (length > SSIZE_MAX) {
 		fprintf(stderr, "fragment too big (%" PRId64 ")\n", length);
 		exit(EXIT_FAILURE);
 	}
 
 	buf = malloc(length);
-	if (buf == NULL) {
+	if (buf == NULL && length) {
 		fprintf(stderr, "out of memory\n");
 		exit(EXIT_FAILURE);
 	}
 
-	if (xpread(fd, buf, length, from) != length) {
+	if (xpread(fd, buf, length, split_offsets[0]) != length) {
 		fprintf(stderr, "read error\n");
 		exit(EXIT_FAILURE);
 	}
 
-	hashfn(buf, length, hash);
+	for (i = 0; i < n; i++) {
+		jobs[i].data = buf + (split_offsets[i] - split_offsets[0]);
+		jobs[i].length = split_offsets[i + 1] - split_offsets[i];
+		jobs[i].md = hash[i];
+	}
+
+	hashfn_batch(jobs, n);
 
 	free(buf);
 
-	len = 0;
-	for (i = 0; i < sizeof(hash); i++) {
-		pbuf[len++] = hexnibble(hash[i] >> 4);
-		pbuf[len++] = hexnibble(hash[i] & 0xf);
+	for (i = 0; i < n; i++) {
+		print_frag(fp, hash[i], split_offsets[i], jobs[i].length,
+			   tag);
 	}
-	len += sprintf(pbuf + len, " %" PRId64 "\n", length);
 
-	fwrite(pbuf, len, 1, fp);
+	return n;
 }
 
 static ssize_t xwrite(int fd, const void *buf, size_t count)
@@ -93,8 +156,8 @@ static void split_cb(void *cookie, int fd, int num, uint64_t *split_offsets)
 
 	fp = open_memstream(&ptr, &size);
 
-	for (i = 0; i < num; i++)
-		split(fp, fd, split_offsets[i], split_offsets[i + 1]);
+	for (i = 0; i < num; )
+		i += split_batch(fp, fd, num - i, split_offsets + i, cookie);
 
 	fclose(fp);
 
@@ -106,16 +169,128 @@ static void split_cb(void *cookie, int fd, int num, uint64_t *split_offsets)
 	free(ptr);
 }
 
+static struct split_level *add_stream(void)
+{
+	struct split_level *level;
+
+	if (num_streams == SPLIT_MAX_LEVELS) {
+		fprintf(stderr, "too many streams\n");
+		exit(EXIT_FAILURE);
+	}
+
+	level = &streams[num_streams];
+	level->cookie = stream_tag[num_streams];
+	num_streams++;
+
+	return level;
+}
+
+static void add_crc_stream(unsigned long thresh)
+{
+	struct split_level *level;
+
+	level = add_stream();
+	level->crc_thresh = thresh;
+	level->block_size = 0;
+	snprintf(level->cookie, sizeof(stream_tag[0]), "crc%#lx", thresh);
+
+	num_crc_streams++;
+}
+
+static void parse_thresholds(char *arg)
+{
+	char *tok;
+	char *saveptr;
+
+	for (tok = strtok_r(arg, ",", &saveptr); tok != NULL;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		unsigned long thresh;
+		char *end;
+
+		thresh = strtoul(tok, &end, 0);
+		if (*end || thresh == 0 || thresh > UINT32_MAX) {
+			fprintf(stderr, "invalid threshold: %s\n", tok);
+			exit(EXIT_FAILURE);
+		}
+
+		add_crc_stream(thresh);
+	}
+}
+
+static void parse_block_sizes(char *arg)
+{
+	char *tok;
+	char *saveptr;
+
+	for (tok = strtok_r(arg, ",", &saveptr); tok != NULL;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		struct split_level *level;
+		unsigned long size;
+		char *end;
+
+		size = strtoul(tok, &end, 0);
+		if (*end == 'k' || *end == 'K') {
+			size <<= 10;
+			end++;
+		} else if (*end == 'm' || *end == 'M') {
+			size <<= 20;
+			end++;
+		}
+
+		if (*end || size == 0 || size > UINT32_MAX) {
+			fprintf(stderr, "invalid block size: %s\n", tok);
+			exit(EXIT_FAILURE);
+		}
+
+		level = add_stream();
+		level->crc_thresh = 0;
+		level->block_size = size;
+		snprintf(level->cookie, sizeof(stream_tag[0]), "b%lu", size);
+	}
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "syntax: %s [-l] [-t thresh[,thresh...]] "
+			"[-b size[,size...]] <file>+\n", progname);
+}
+
 int main(int argc, char *argv[])
 {
+	int opt;
 	int i;
 
-	if (argc < 2) {
-		fprintf(stderr, "syntax: %s <file>+\n", argv[0]);
+	while ((opt = getopt(argc, argv, "b:lt:")) != -1) {
+		switch (opt) {
+		case 'b':
+			parse_block_sizes(optarg);
+			break;
+		case 'l':
+			locations = 1;
+			break;
+		case 't':
+			parse_thresholds(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind == argc) {
+		usage(argv[0]);
 		return 1;
 	}
 
-	for (i = 1; i < argc; i++) {
+	/*
+	 * Fixed-size blocks are meant as a baseline to compare content
+	 * defined chunking against, so split at the default threshold
+	 * as well if no thresholds were given explicitly.
+	 */
+	if (num_streams && !num_crc_streams)
+		add_crc_stream(SPLIT_CRC_THRESH);
+
+	for (i = optind; i < argc; i++) {
 		int srcfd;
 		struct split_job sj;
 
@@ -125,13 +300,22 @@ int main(int argc, char *argv[])
 			continue;
 		}
 
+		cur_file = argv[i];
+
 		sj.fd = srcfd;
 		sj.file = argv[i];
-		sj.crc_block_size = 64;
-		sj.crc_thresh = 0x00001000;
+		sj.crc_block_size = SPLIT_CRC_BLOCK_SIZE;
+		sj.crc_thresh = SPLIT_CRC_THRESH;
 		sj.cookie = NULL;
 		sj.handler_split = split_cb;
-		do_split(&sj);
+
+		if (num_streams) {
+			sj.num_levels = num_streams;
+			memcpy(sj.levels, streams, sizeof(streams));
+			do_split_levels(&sj);
+		} else {
+			do_split(&sj);
+		}
 
 		close(srcfd);
 	}
@@ -0,0 +1,63 @@
+#ifndef __RECIPE_H
+#define __RECIPE_H
+
+#include <stdint.h>
+#include "hash.h"
+
+/*
+ * A recipe describes a file stored in a content-addressed fragment
+ * store as an ordered list of fragments.  It consists of a fixed
+ * header followed by num_entries entries sorted by start offset,
+ * all in host byte order.  Fragment data lives in the store under
+ * a two-level fan-out directory tree, as ab/cd/abcd...
+ *
+ * A stored fragment is either the raw fragment data, or, if its size
+ * is less than the fragment length, a single zstd frame that
+ * decompresses to the fragment data.
+ */
+#define RECIPE_MAGIC		"fasdup recipe 1\n"
+
+struct recipe_header {
+	char		magic[16];
+	uint64_t	num_entries;
+	uint64_t	file_size;
+};
+
+struct recipe_entry {
+	uint64_t	start;
+	uint64_t	length;
+	uint8_t		hash[HASH_LENGTH];
+};
+
+#define RECIPE_STORE_PATH_MAX	(6 + 2 * HASH_LENGTH + 1)
+
+static inline char recipe_hexnibble(int n)
+{
+	if (n < 10)
+		return '0' + n;
+	else
+		return 'a' + (n - 10);
+}
+
+static inline void recipe_store_path(char *path, const uint8_t *hash)
+{
+	char *p;
+	int i;
+
+	p = path + 6;
+	for (i = 0; i < HASH_LENGTH; i++) {
+		*p++ = recipe_hexnibble(hash[i] >> 4);
+		*p++ = recipe_hexnibble(hash[i] & 0xf);
+	}
+	*p = 0;
+
+	path[0] = path[6];
+	path[1] = path[7];
+	path[2] = '/';
+	path[3] = path[8];
+	path[4] = path[9];
+	path[5] = '/';
+}
+
+
+#endif
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <immintrin.h>
+#include <openssl/sha.h>
+#include <stdint.h>
+#include <string.h>
+#include "sha512_mb.h"
+
+#define SHA512_BLOCK_SIZE	128
+#define MAX_LANES		8
+
+static const uint64_t sha512_k[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL,
+	0xe9b5dba58189dbbcULL, 0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+	0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL, 0xd807aa98a3030242ULL,
+	0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL,
+	0xc19bf174cf692694ULL, 0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+	0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL, 0x2de92c6f592b0275ULL,
+	0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL,
+	0xbf597fc7beef0ee4ULL, 0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+	0x06ca6351e003826fULL, 0x142929670a0e6e70ULL, 0x27b70a8546d22ffcULL,
+	0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL,
+	0x92722c851482353bULL, 0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+	0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL, 0xd192e819d6ef5218ULL,
+	0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL,
+	0x34b0bcb5e19b48a8ULL, 0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+	0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL, 0x748f82ee5defb2fcULL,
+	0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL,
+	0xc67178f2e372532bULL, 0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+	0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL, 0x06f067aa72176fbaULL,
+	0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL,
+	0x431d67c49c100d4cULL, 0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+	0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+static const uint64_t sha512_iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL,
+	0xa54ff53a5f1d36f1ULL, 0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+	0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+/*
+ * The state of all lanes is kept in memory transposed, i.e. as
+ * state[word][lane], so that each state word of all lanes can be
+ * loaded into a single vector.  The compression functions process
+ * one 128-byte block per lane.
+ */
+typedef void (*compress_fn)(uint64_t state[8][MAX_LANES],
+			    const uint8_t *const *blocks);
+
+#define ROTR(x, n)	_mm256_or_si256(_mm256_srli_epi64(x, n), \
+					_mm256_slli_epi64(x, 64 - (n)))
+
+__attribute__((target("avx2")))
+static void compress_avx2(uint64_t state[8][MAX_LANES],
+			  const uint8_t *const *blocks)
+{
+	const __m256i bswap = _mm256_set_epi8(
+		8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+		8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i w[16];
+	__m256i s[8];
+	__m256i a, b, c, d, e, f, g, h;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		__m256i r0, r1, r2, r3;
+		__m256i t0, t1, t2, t3;
+
+		r0 = _mm256_loadu_si256((const __m256i *)blocks[0] + i);
+		r1 = _mm256_loadu_si256((const __m256i *)blocks[1] + i);
+		r2 = _mm256_loadu_si256((const __m256i *)blocks[2] + i);
+		r3 = _mm256_loadu_si256((const __m256i *)blocks[3] + i);
+
+		t0 = _mm256_unpacklo_epi64(r0, r1);
+		t1 = _mm256_unpackhi_epi64(r0, r1);
+		t2 = _mm256_unpacklo_epi64(r2, r3);
+		t3 = _mm256_unpackhi_epi64(r2, r3);
+
+		w[4 * i + 0] = _mm256_shuffle_epi8(
+			_mm256_permute2x128_si256(t0, t2, 0x20), bswap);
+		w[4 * i + 1] = _mm256_shuffle_epi8(
+			_mm256_permute2x128_si256(t1, t3, 0x20), bswap);
+		w[4 * i + 2] = _mm256_shuffle_epi8(
+			_mm256_permute2x128_si256(t0, t2, 0x31), bswap);
+		w[4 * i + 3] = _mm256_shuffle_epi8(
+			_mm256_permute2x128_si256(t1, t3, 0x31), bswap);
+	}
+
+	for (i = 0; i < 8; i++)
+		s[i] = _mm256_loadu_si256((const __m256i *)state[i]);
+
+	a = s[0];
+	b = s[1];
+	c = s[2];
+	d = s[3];
+	e = s[4];
+	f = s[5];
+	g = s[6];
+	h = s[7];
+
+	for (i = 0; i < 80; i++) {
+		__m256i wi;
+		__m256i t1;
+		__m256i t2;
+
+		if (i < 16) {
+			wi = w[i];
+		} else {
+			__m256i w2 = w[(i - 2) & 15];
+			__m256i w15 = w[(i - 15) & 15];
+			__m256i s0;
+			__m256i s1;
+
+			s0 = _mm256_xor_si256(_mm256_xor_si256(ROTR(w15, 1),
+				ROTR(w15, 8)), _mm256_srli_epi64(w15, 7));
+			s1 = _mm256_xor_si256(_mm256_xor_si256(ROTR(w2, 19),
+				ROTR(w2, 61)), _mm256_srli_epi64(w2, 6));
+
+			wi = _mm256_add_epi64(_mm256_add_epi64(w[i & 15], s0),
+				_mm256_add_epi64(w[(i - 7) & 15], s1));
+			w[i & 15] = wi;
+		}
+
+		t1 = _mm256_add_epi64(h, _mm256_xor_si256(_mm256_xor_si256(
+			ROTR(e, 14), ROTR(e, 18)), ROTR(e, 41)));
+		t1 = _mm256_add_epi64(t1, _mm256_xor_si256(
+			_mm256_and_si256(e, f), _mm256_andnot_si256(e, g)));
+		t1 = _mm256_add_epi64(t1, _mm256_add_epi64(wi,
+			_mm256_set1_epi64x(sha512_k[i])));
+
+		t2 = _mm256_xor_si256(_mm256_xor_si256(ROTR(a, 28),
+			ROTR(a, 34)), ROTR(a, 39));
+		t2 = _mm256_add_epi64(t2, _mm256_or_si256(
+			_mm256_and_si256(a, b),
+			_mm256_and_si256(c, _mm256_or_si256(a, b))));
+
+		h = g;
+		g = f;
+		f = e;
+		e = _mm256_add_epi64(d, t1);
+		d = c;
+		c = b;
+		b = a;
+		a = _mm256_add_epi64(t1, t2);
+	}
+
+	s[0] = _mm256_add_epi64(s[0], a);
+	s[1] = _mm256_add_epi64(s[1], b);
+	s[2] = _mm256_add_epi64(s[2], c);
+	s[3] = _mm256_add_epi64(s[3], d);
+	s[4] = _mm256_add_epi64(s[4], e);
+	s[5] = _mm256_add_epi64(s[5], f);
+	s[6] = _mm256_add_epi64(s[6], g);
+	s[7] = _mm256_add_epi64(s[7], h);
+
+	for (i = 0; i < 8; i++)
+		_mm256_storeu_si256((__m256i *)state[i], s[i]);
+}
+
+#undef ROTR
+
+/*
+ * The AVX-512 version gathers the message words of all eight lanes
+ * straight from the blocks, using the block addresses themselves as
+ * gather indices, and uses the native rotate and ternary logic
+ * instructions for the round functions.
+ */
+#define ROTR(x, n)	_mm512_ror_epi64(x, n)
+#define XOR3(x, y, z)	_mm512_ternarylogic_epi64(x, y, z, 0x96)
+
+__attribute__((target("avx512f,avx512bw")))
+static void compress_avx512(uint64_t state[8][MAX_LANES],
+			    const uint8_t *const *blocks)
+{
+	const __m512i bswap = _mm512_set_epi64(
+		0x08090a0b0c0d0e0fULL, 0x0001020304050607ULL,
+		0x08090a0b0c0d0e0fULL, 0x0001020304050607ULL,
+		0x08090a0b0c0d0e0fULL, 0x0001020304050607ULL,
+		0x08090a0b0c0d0e0fULL, 0x0001020304050607ULL);
+	__m512i addr;
+	__m512i w[16];
+	__m512i s[8];
+	__m512i a, b, c, d, e, f, g, h;
+	int i;
+
+	addr = _mm512_loadu_si512((const void *)blocks);
+
+	for (i = 0; i < 16; i++) {
+		__m512i idx;
+
+		idx = _mm512_add_epi64(addr, _mm512_set1_epi64(8 * i));
+		w[i] = _mm512_shuffle_epi8(
+			_mm512_i64gather_epi64(idx, NULL, 1), bswap);
+	}
+
+	for (i = 0; i < 8; i++)
+		s[i] = _mm512_loadu_si512((const void *)state[i]);
+
+	a = s[0];
+	b = s[1];
+	c = s[2];
+	d = s[3];
+	e = s[4];
+	f = s[5];
+	g = s[6];
+	h = s[7];
+
+	for (i = 0; i < 80; i++) {
+		__m512i wi;
+		__m512i t1;
+		__m512i t2;
+
+		if (i < 16) {
+			wi = w[i];
+		} else {
+			__m512i w2 = w[(i - 2) & 15];
+			__m512i w15 = w[(i - 15) & 15];
+			__m512i s0;
+			__m512i s1;
+
+			s0 = XOR3(ROTR(w15, 1), ROTR(w15, 8),
+				  _mm512_srli_epi64(w15, 7));
+			s1 = XOR3(ROTR(w2, 19), ROTR(w2, 61),
+				  _mm512_srli_epi64(w2, 6));
+
+			wi = _mm512_add_epi64(_mm512_add_epi64(w[i & 15], s0),
+				_mm512_add_epi64(w[(i - 7) & 15], s1));
+			w[i & 15] = wi;
+		}
+
+		t1 = _mm512_add_epi64(h, XOR3(ROTR(e, 14), ROTR(e, 18),
+					      ROTR(e, 41)));
+		t1 = _mm512_add_epi64(t1,
+			_mm512_ternarylogic_epi64(e, f, g, 0xca));
+		t1 = _mm512_add_epi64(t1, _mm512_add_epi64(wi,
+			_mm512_set1_epi64(sha512_k[i])));
+
+		t2 = _mm512_add_epi64(XOR3(ROTR(a, 28), ROTR(a, 34),
+					   ROTR(a, 39)),
+			_mm512_ternarylogic_epi64(a, b, c, 0xe8));
+
+		h = g;
+		g = f;
+		f = e;
+		e = _mm512_add_epi64(d, t1);
+		d = c;
+		c = b;
+		b = a;
+		a = _mm512_add_epi64(t1, t2);
+	}
+
+	s[0] = _mm512_add_epi64(s[0], a);
+	s[1] = _mm512_add_epi64(s[1], b);
+	s[2] = _mm512_add_epi64(s[2], c);
+	s[3] = _mm512_add_epi64(s[3], d);
+	s[4] = _mm512_add_epi64(s[4], e);
+	s[5] = _mm512_add_epi64(s[5], f);
+	s[6] = _mm512_add_epi64(s[6], g);
+	s[7] = _mm512_add_epi64(s[7], h);
+
+	for (i = 0; i < 8; i++)
+		_mm512_storeu_si512((void *)state[i], s[i]);
+}
+
+#undef XOR3
+#undef ROTR
+
+/*
+ * A lane works through the full blocks of its message in place, and
+ * then through one or two final blocks in tail[], which hold the
+ * remainder of the message followed by the padding and the message
+ * length in bits.
+ */
+struct lane {
+	struct sha512_mb_job	*job;
+	uint64_t		block;
+	uint64_t		full_blocks;
+	uint64_t		num_blocks;
+	uint8_t			tail[2 * SHA512_BLOCK_SIZE];
+};
+
+static void store_be64(uint8_t *p, uint64_t v)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		p[i] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+static void lane_start(struct lane *l, uint64_t state[8][MAX_LANES],
+		       int lane, struct sha512_mb_job *job)
+{
+	size_t rem;
+	int tail_blocks;
+	int i;
+
+	l->job = job;
+	l->block = 0;
+	l->full_blocks = job->length / SHA512_BLOCK_SIZE;
+
+	rem = job->length % SHA512_BLOCK_SIZE;
+	tail_blocks = (rem + 1 + 16 <= SHA512_BLOCK_SIZE) ? 1 : 2;
+	l->num_blocks = l->full_blocks + tail_blocks;
+
+	memset(l->tail, 0, sizeof(l->tail));
+	memcpy(l->tail, job->data + l->full_blocks * SHA512_BLOCK_SIZE, rem);
+	l->tail[rem] = 0x80;
+	store_be64(l->tail + tail_blocks * SHA512_BLOCK_SIZE - 16,
+		   job->length >> 61);
+	store_be64(l->tail + tail_blocks * SHA512_BLOCK_SIZE - 8,
+		   job->length << 3);
+
+	for (i = 0; i < 8; i++)
+		state[i][lane] = sha512_iv[i];
+}
+
+static const uint8_t *lane_block(const struct lane *l)
+{
+	if (l->block < l->full_blocks)
+		return l->job->data + l->block * SHA512_BLOCK_SIZE;
+
+	return l->tail + (l->block - l->full_blocks) * SHA512_BLOCK_SIZE;
+}
+
+static void sha512_mb_run(struct sha512_mb_job *jobs, int num, int lanes,
+			  compress_fn compress)
+{
+	static const uint8_t idle_block[SHA512_BLOCK_SIZE];
+	uint64_t state[8][MAX_LANES] __attribute__((aligned(64)));
+	const uint8_t *blocks[MAX_LANES] __attribute__((aligned(64)));
+	struct lane lane[MAX_LANES];
+	int next;
+	int active;
+	int i;
+
+	next = 0;
+	active = 0;
+	for (i = 0; i < lanes; i++) {
+		if (next < num) {
+			lane_start(&lane[i], state, i, &jobs[next++]);
+			active++;
+		} else {
+			lane[i].job = NULL;
+		}
+	}
+
+	while (active) {
+		for (i = 0; i < lanes; i++) {
+			blocks[i] = (lane[i].job != NULL) ?
+				    lane_block(&lane[i]) : idle_block;
+		}
+
+		compress(state, blocks);
+
+		for (i = 0; i < lanes; i++) {
+			struct lane *l = &lane[i];
+			int j;
+
+			if (l->job == NULL || ++l->block < l->num_blocks)
+				continue;
+
+			for (j = 0; j < 8; j++)
+				store_be64(l->job->md + 8 * j, state[j][i]);
+
+			if (next < num) {
+				lane_start(l, state, i, &jobs[next++]);
+			} else {
+				l->job = NULL;
+				active--;
+			}
+		}
+	}
+}
+
+void sha512_mb(struct sha512_mb_job *jobs, int num)
+{
+	int i;
+
+	if (num > 4 && __builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("avx512bw")) {
+		sha512_mb_run(jobs, num, 8, compress_avx512);
+		return;
+	}
+
+	if (num > 1 && __builtin_cpu_supports("avx2")) {
+		sha512_mb_run(jobs, num, 4, compress_avx2);
+		return;
+	}
+
+	for (i = 0; i < num; i++)
+		SHA512(jobs[i].data, jobs[i].length, jobs[i].md);
+}
@@ -0,0 +1,25 @@
+#ifndef __SHA512_MB_H
+#define __SHA512_MB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Multi-buffer SHA-512: hashes a number of independent messages at
+ * once, with each message occupying one SIMD lane.  When a message is
+ * done, the next one is started in its lane, so messages of differing
+ * lengths keep all lanes busy.  On CPUs without AVX2, the messages
+ * are simply hashed one by one.
+ */
+#define SHA512_MB_DIGEST_LENGTH	64
+
+struct sha512_mb_job {
+	const uint8_t	*data;
+	size_t		length;
+	uint8_t		*md;
+};
+
+void sha512_mb(struct sha512_mb_job *jobs, int num);
+
+
+#endif
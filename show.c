@@ -40,8 +40,8 @@ int main(int argc, char *argv[])
 
 	sj.fd = srcfd;
 	sj.file = argv[1];
-	sj.crc_block_size = 64;
-	sj.crc_thresh = 0x00001000;
+	sj.crc_block_size = SPLIT_CRC_BLOCK_SIZE;
+	sj.crc_thresh = SPLIT_CRC_THRESH;
 	sj.cookie = NULL;
 	sj.handler_split = split;
 	do_split(&sj);
@@ -5,12 +5,102 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <zstd.h>
+#include "common.h"
+#include "fragindex.h"
+#include "hash.h"
+#include "recipe.h"
 #include "splitpoints.h"
 
+struct entry_list {
+	pthread_mutex_t	lock;
+	size_t		entry_size;
+	void		*entries;
+	uint64_t	num;
+	uint64_t	alloc;
+};
+
 static int dirfd;
+static int storefd = -1;
+static int write_index;
+static int compress_level;
+
+static struct entry_list recipe = {
+	PTHREAD_MUTEX_INITIALIZER, sizeof(struct recipe_entry),
+};
+
+static struct entry_list fragindex = {
+	PTHREAD_MUTEX_INITIALIZER, sizeof(struct fragindex_entry),
+};
+
+static void add_entries(struct entry_list *el, const void *ent, int num)
+{
+	pthread_mutex_lock(&el->lock);
+
+	if (el->num + num > el->alloc) {
+		el->alloc = el->alloc ? 2 * el->alloc : 1024;
+		if (el->alloc < el->num + num)
+			el->alloc = el->num + num;
+
+		el->entries = realloc(el->entries, el->alloc * el->entry_size);
+		if (el->entries == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	memcpy(el->entries + el->num * el->entry_size, ent,
+	       num * el->entry_size);
+	el->num += num;
+
+	pthread_mutex_unlock(&el->lock);
+}
+
+/*
+ * Fragments are written sparsely: holes in the source file are not
+ * copied, and neither are all-zero blocks of store fragments, so that
+ * splitting a sparse image doesn't inflate it, and so that splitfs
+ * can report the holes through SEEK_HOLE.
+ */
+#define SPARSE_BLOCK_SIZE	4096
+
+/*
+ * Copy [from, to) of the source file to the fragment starting at
+ * base in the source file.
+ */
+static void copy_range(int srcfd, int fd, uint64_t base, uint64_t from,
+		       uint64_t to)
+{
+	off_t off;
+	off_t outoff;
+
+	off = from;
+	outoff = from - base;
+	while (off < to) {
+		ssize_t ret;
+
+		do {
+			ret = copy_file_range(srcfd, &off, fd,
+					      &outoff, to - off, 0);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0) {
+			perror("copy_file_range");
+			exit(EXIT_FAILURE);
+		}
+
+		if (ret == 0) {
+			fprintf(stderr, "copy_file_range EOF\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
 
 static void split(int srcfd, uint64_t from, uint64_t to)
 {
@@ -31,67 +121,527 @@ static void split(int srcfd, uint64_t from, uint64_t to)
 
 	off = from;
 	while (off < to) {
-		ssize_t ret;
+		off_t data;
+		off_t hole;
 
-		do {
-			ret = copy_file_range(srcfd, &off, fd,
-					      NULL, to - off, 0);
-		} while (ret < 0 && errno == EINTR);
-
-		if (ret < 0) {
-			perror("copy_file_range");
+		data = lseek(srcfd, off, SEEK_DATA);
+		if (data < 0 && errno == ENXIO)
+			break;
+		if (data < 0) {
+			perror("lseek");
 			exit(EXIT_FAILURE);
 		}
+		if (data >= to)
+			break;
 
-		if (ret == 0) {
-			fprintf(stderr, "copy_file_range EOF\n");
+		hole = lseek(srcfd, data, SEEK_HOLE);
+		if (hole < 0) {
+			perror("lseek");
 			exit(EXIT_FAILURE);
 		}
+		if (hole > to)
+			hole = to;
+
+		copy_range(srcfd, fd, from, data, hole);
+
+		off = hole;
+	}
+
+	if (ftruncate(fd, to - from) < 0) {
+		perror("ftruncate");
+		exit(EXIT_FAILURE);
 	}
 
 	close(fd);
 }
 
+static void xmkdirat(int dirfd, const char *path)
+{
+	if (mkdirat(dirfd, path, 0777) < 0 && errno != EEXIST) {
+		perror("mkdirat");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Estimate whether a fragment is worth compressing from the byte
+ * frequencies in a sample of it.  The sum of the squared counts is
+ * close to n^2 / 256 for random-looking data such as already
+ * compressed or encrypted data, and grows as the byte distribution
+ * gets more skewed.
+ */
+#define PROBE_CHUNKS		64
+#define PROBE_CHUNK_SIZE	64
+
+static int looks_compressible(const uint8_t *buf, uint64_t length)
+{
+	uint32_t count[256];
+	uint64_t stride;
+	uint64_t n;
+	uint64_t sum;
+	int i;
+
+	memset(count, 0, sizeof(count));
+
+	stride = length / PROBE_CHUNKS;
+	if (stride < PROBE_CHUNK_SIZE)
+		stride = PROBE_CHUNK_SIZE;
+
+	n = 0;
+	for (i = 0; i < PROBE_CHUNKS && i * stride < length; i++) {
+		const uint8_t *p = buf + i * stride;
+		uint64_t len;
+		uint64_t j;
+
+		len = length - i * stride;
+		if (len > PROBE_CHUNK_SIZE)
+			len = PROBE_CHUNK_SIZE;
+
+		for (j = 0; j < len; j++)
+			count[p[j]]++;
+		n += len;
+	}
+
+	sum = 0;
+	for (i = 0; i < 256; i++)
+		sum += (uint64_t)count[i] * count[i];
+
+	/*
+	 * For uniformly random bytes, 256 * sum / n^2 is about
+	 * 1 + 255 / n, so anything within 25% of that is treated as
+	 * incompressible.
+	 */
+	return 4 * 256 * sum > 5 * (n * n + 255 * n);
+}
+
+/*
+ * Compress a fragment if that saves at least 1/64th of its size.
+ * Returns the compressed data, or NULL if it should be stored raw.
+ */
+static void *compress_fragment(const uint8_t *buf, uint64_t length,
+			       size_t *clength)
+{
+	size_t bound;
+	void *cbuf;
+	size_t ret;
+
+	if (length < 64 || !looks_compressible(buf, length))
+		return NULL;
+
+	bound = ZSTD_compressBound(length);
+
+	cbuf = malloc(bound);
+	if (cbuf == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	ret = ZSTD_compress(cbuf, bound, buf, length, compress_level);
+	if (ZSTD_isError(ret) || ret > length - length / 64) {
+		free(cbuf);
+		return NULL;
+	}
+
+	*clength = ret;
+
+	return cbuf;
+}
+
+static int is_zero(const uint8_t *buf, size_t length)
+{
+	return buf[0] == 0 && !memcmp(buf, buf + 1, length - 1);
+}
+
+/*
+ * The number of bytes of data that a sparse copy of buf would hold.
+ */
+static uint64_t sparse_size(const uint8_t *buf, uint64_t length)
+{
+	uint64_t size;
+	uint64_t off;
+
+	size = 0;
+	for (off = 0; off < length; off += SPARSE_BLOCK_SIZE) {
+		uint64_t block;
+
+		block = length - off;
+		if (block > SPARSE_BLOCK_SIZE)
+			block = SPARSE_BLOCK_SIZE;
+
+		if (!is_zero(buf + off, block))
+			size += block;
+	}
+
+	return size;
+}
+
+static void write_sparse(int fd, const uint8_t *buf, uint64_t length)
+{
+	uint64_t off;
+
+	off = 0;
+	while (off < length) {
+		uint64_t end;
+
+		end = off + SPARSE_BLOCK_SIZE;
+		if (end > length)
+			end = length;
+
+		if (is_zero(buf + off, end - off)) {
+			off = end;
+			continue;
+		}
+
+		while (end < length) {
+			uint64_t next;
+
+			next = end + SPARSE_BLOCK_SIZE;
+			if (next > length)
+				next = length;
+
+			if (is_zero(buf + end, next - end))
+				break;
+
+			end = next;
+		}
+
+		xpwrite(fd, buf + off, end - off, off);
+		off = end;
+	}
+
+	if (ftruncate(fd, length) < 0) {
+		perror("ftruncate");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void store_fragment(const uint8_t *buf, uint64_t length,
+			   const uint8_t *hash)
+{
+	char path[RECIPE_STORE_PATH_MAX];
+	char tmp[RECIPE_STORE_PATH_MAX + 64];
+	struct stat statbuf;
+	void *cbuf;
+	size_t clength;
+	int fd;
+
+	recipe_store_path(path, hash);
+
+	if (fstatat(storefd, path, &statbuf, 0) == 0)
+		return;
+
+	if (errno != ENOENT) {
+		perror("fstatat");
+		exit(EXIT_FAILURE);
+	}
+
+	path[2] = 0;
+	xmkdirat(storefd, path);
+	path[2] = '/';
+
+	path[5] = 0;
+	xmkdirat(storefd, path);
+	path[5] = '/';
+
+	/*
+	 * Write to a temporary name and rename it into place, so that
+	 * a fragment present under its final name is always complete,
+	 * even if several threads store the same fragment at once.
+	 */
+	snprintf(tmp, sizeof(tmp), "%s.%d.%lx", path, getpid(),
+		 (unsigned long)pthread_self());
+
+	fd = openat(storefd, tmp, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+	if (fd < 0) {
+		perror("openat");
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * Fragments whose zeroes account for most of what compression
+	 * would save are better stored sparsely, which keeps their
+	 * holes visible to SEEK_HOLE.
+	 */
+	cbuf = NULL;
+	if (compress_level) {
+		cbuf = compress_fragment(buf, length, &clength);
+		if (cbuf != NULL) {
+			uint64_t sparse = sparse_size(buf, length);
+
+			if (clength >= sparse - sparse / 64) {
+				free(cbuf);
+				cbuf = NULL;
+			}
+		}
+	}
+
+	if (cbuf != NULL) {
+		xpwrite(fd, cbuf, clength, 0);
+		free(cbuf);
+	} else {
+		write_sparse(fd, buf, length);
+	}
+
+	close(fd);
+
+	if (renameat(storefd, tmp, storefd, path) < 0) {
+		perror("renameat");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void split_store(int srcfd, uint64_t from, uint64_t to,
+			struct recipe_entry *ent)
+{
+	uint64_t length;
+	uint8_t *buf;
+
+	printf("%" PRId64 "\r", from);
+	fflush(stdout);
+
+	length = to - from;
+	if (length > SSIZE_MAX) {
+		fprintf(stderr, "fragment too big (%" PRId64 ")\n", length);
+		exit(EXIT_FAILURE);
+	}
+
+	buf = malloc(length);
+	if (buf == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (xpread(srcfd, buf, length, from) != length) {
+		fprintf(stderr, "read error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	ent->start = from;
+	ent->length = length;
+	hashfn(buf, length, ent->hash);
+
+	store_fragment(buf, length, ent->hash);
+
+	free(buf);
+}
+
 static void split_cb(void *cookie, int fd, int num, uint64_t *split_offsets)
 {
+	struct recipe_entry *ent;
 	int i;
 
-	for (i = 0; i < num; i++)
-		split(fd, split_offsets[i], split_offsets[i + 1]);
+	if (storefd < 0) {
+		struct fragindex_entry *frag;
+
+		for (i = 0; i < num; i++)
+			split(fd, split_offsets[i], split_offsets[i + 1]);
+
+		if (!write_index)
+			return;
+
+		frag = malloc(num * sizeof(*frag));
+		if (frag == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < num; i++) {
+			frag[i].start = split_offsets[i];
+			frag[i].end = split_offsets[i + 1];
+		}
+
+		add_entries(&fragindex, frag, num);
+
+		free(frag);
+
+		return;
+	}
+
+	ent = malloc(num * sizeof(*ent));
+	if (ent == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < num; i++) {
+		split_store(fd, split_offsets[i], split_offsets[i + 1],
+			    ent + i);
+	}
+
+	add_entries(&recipe, ent, num);
+
+	free(ent);
+}
+
+static int compare_recipe_entries(const void *_a, const void *_b)
+{
+	const struct recipe_entry *a = _a;
+	const struct recipe_entry *b = _b;
+
+	if (a->start < b->start)
+		return -1;
+	if (a->start > b->start)
+		return 1;
+
+	return 0;
+}
+
+static void write_recipe(const char *file, uint64_t file_size)
+{
+	struct recipe_entry *ent = recipe.entries;
+	struct recipe_header hdr;
+	uint64_t i;
+	uint64_t j;
+	int fd;
+
+	/*
+	 * Fragments are handed to us out of order by the split
+	 * threads, so sort them, and drop the zero-length fragment
+	 * that do_split_levels() reports for an empty file.
+	 */
+	qsort(ent, recipe.num, sizeof(*ent), compare_recipe_entries);
+
+	j = 0;
+	for (i = 0; i < recipe.num; i++) {
+		if (ent[i].length)
+			ent[j++] = ent[i];
+	}
+	recipe.num = j;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, RECIPE_MAGIC, sizeof(hdr.magic));
+	hdr.num_entries = recipe.num;
+	hdr.file_size = file_size;
+
+	fd = open(file, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+	if (fd < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+
+	xpwrite(fd, &hdr, sizeof(hdr), 0);
+	xpwrite(fd, ent, recipe.num * sizeof(*ent), sizeof(hdr));
+
+	close(fd);
+}
+
+static int compare_fragindex_entries(const void *_a, const void *_b)
+{
+	const struct fragindex_entry *a = _a;
+	const struct fragindex_entry *b = _b;
+
+	if (a->start < b->start)
+		return -1;
+	if (a->start > b->start)
+		return 1;
+
+	return 0;
+}
+
+static void write_fragindex(uint64_t file_size)
+{
+	struct fragindex_entry *ent = fragindex.entries;
+	struct fragindex_header hdr;
+	int fd;
+
+	qsort(ent, fragindex.num, sizeof(*ent), compare_fragindex_entries);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, FRAGINDEX_MAGIC, sizeof(hdr.magic));
+	hdr.num_entries = fragindex.num;
+	hdr.file_size = file_size;
+
+	fd = openat(dirfd, FRAGINDEX_NAME, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+	if (fd < 0) {
+		perror("openat");
+		exit(EXIT_FAILURE);
+	}
+
+	xpwrite(fd, &hdr, sizeof(hdr), 0);
+	xpwrite(fd, ent, fragindex.num * sizeof(*ent), sizeof(hdr));
+
+	close(fd);
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "syntax: %s [-i] <dstdir> <file>\n", progname);
+	fprintf(stderr, "        %s -s <storedir> [-z level] <recipe> <file>\n",
+		progname);
 }
 
 int main(int argc, char *argv[])
 {
+	const char *store;
+	int opt;
 	int srcfd;
 	struct split_job sj;
 
-	if (argc != 3) {
-		fprintf(stderr, "syntax: %s <dstdir> <file>\n", argv[0]);
-		return 1;
+	store = NULL;
+	while ((opt = getopt(argc, argv, "is:z:")) != -1) {
+		switch (opt) {
+		case 'i':
+			write_index = 1;
+			break;
+		case 's':
+			store = optarg;
+			break;
+		case 'z':
+			compress_level = atoi(optarg);
+			if (compress_level <= 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
 	}
 
-	dirfd = open(argv[1], O_DIRECTORY | O_PATH);
-	if (dirfd < 0) {
-		perror("opendir");
+	if (argc - optind != 2 || (compress_level && store == NULL)) {
+		usage(argv[0]);
 		return 1;
 	}
 
-	srcfd = open(argv[2], O_RDONLY);
+	if (store != NULL) {
+		storefd = open(store, O_DIRECTORY | O_PATH);
+		if (storefd < 0) {
+			perror("opendir");
+			return 1;
+		}
+	} else {
+		dirfd = open(argv[optind], O_DIRECTORY | O_PATH);
+		if (dirfd < 0) {
+			perror("opendir");
+			return 1;
+		}
+	}
+
+	srcfd = open(argv[optind + 1], O_RDONLY);
 	if (srcfd < 0) {
 		perror("open");
 		return 1;
 	}
 
 	sj.fd = srcfd;
-	sj.file = argv[2];
-	sj.crc_block_size = 64;
-	sj.crc_thresh = 0x00001000;
-	sj.cookie = NULL;
+	sj.file = argv[optind + 1];
+	sj.crc_block_size = SPLIT_CRC_BLOCK_SIZE;
 	sj.handler_split = split_cb;
-	do_split(&sj);
+	sj.num_levels = 1;
+	sj.levels[0].crc_thresh = SPLIT_CRC_THRESH;
+	sj.levels[0].block_size = 0;
+	sj.levels[0].max_size = SPLIT_MAX_FRAG_SIZE;
+	sj.levels[0].cookie = NULL;
+	do_split_levels(&sj);
 
 	printf("\n");
 
+	if (storefd >= 0)
+		write_recipe(argv[optind], sj.file_size);
+	else if (write_index)
+		write_fragindex(sj.file_size);
+
 	close(srcfd);
 
 	return 0;
@@ -9,30 +9,381 @@
 #include <stdlib.h>
 #include <dirent.h>
 #include <errno.h>
-#include <fuse.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
 #include <iv_avl.h>
 #include <iv_list.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <unistd.h>
+#include <zstd.h>
+#include "fragindex.h"
+#include "recipe.h"
+#include "splitpoints.h"
 
 #define DIV_ROUND_UP(a, b)	(((a) + (b) - 1) / (b))
 
+struct splitfs_frag_table {
+	int			refcount;
+	uint64_t		size;
+	uint64_t		num_frags;
+	struct fragindex_entry	frags[0];
+};
+
+#define FD_CACHE_SIZE		16
+
+struct splitfs_cached_fd {
+	uint64_t		start;
+	int			fd;
+	int			compressed;
+	uint64_t		last_use;
+};
+
 struct splitfs_file_info {
+	char			*stats;
+	size_t			stats_length;
+
+	struct splitfs_inode	*inode;
+	struct iv_list_head	list;
+	int			writable;
+
 	int			fd;
+	dev_t			dev;
+	ino_t			ino;
+	int			is_plain_file;
+	int			backing_id;
 	int			is_fragmented_file;
-	struct iv_avl_tree	fragments;
+	struct splitfs_frag_table	*table;
 	uint64_t		size;
+	uint64_t		cursor;
+	uint64_t		next_offset;
+	uint64_t		prefetch_start;
+	uint64_t		prefetched;
+
+	int			is_recipe_file;
+	void			*recipe_map;
+	size_t			recipe_map_length;
+	const struct recipe_entry	*recipe;
+	uint64_t		recipe_entries;
+
+	pthread_mutex_t		fd_cache_lock;
+	uint64_t		fd_cache_clock;
+	struct splitfs_cached_fd	fd_cache[FD_CACHE_SIZE];
+};
+
+/*
+ * Every inode the kernel knows about is backed by an O_PATH fd for
+ * the corresponding backing file or directory, and is identified to
+ * the kernel by its address.  Inodes are also indexed by backing
+ * device and inode number, so that hard links and repeated lookups
+ * map to the same inode.
+ */
+struct splitfs_inode {
+	struct iv_avl_node	an;
+	int			fd;
+	dev_t			dev;
+	ino_t			ino;
+	uint64_t		nlookup;
+	int			wd;
+
+	int			recipe_valid;
+	struct timespec		recipe_ctime;
+	int			is_recipe;
+	uint64_t		recipe_size;
+
+	pthread_rwlock_t	rwlock;
+	struct iv_list_head	open_files;
+	int			rewrite_index;
+};
+
+struct splitfs_dir {
+	DIR			*dirp;
+	struct dirent		*entry;
+	off_t			offset;
 };
 
-struct splitfs_file_fragment {
+/*
+ * Fragment tables are cached per fragment directory, keyed by the
+ * directory's device and inode number, and are revalidated against
+ * the directory's mtime and ctime, which change whenever fragments
+ * are added, removed or renamed.
+ */
+struct splitfs_layout {
 	struct iv_avl_node	an;
+	struct iv_list_head	list;
+	dev_t			dev;
+	ino_t			ino;
+	struct timespec		mtime;
+	struct timespec		ctime;
+	struct splitfs_frag_table	*table;
+};
+
+#define LAYOUT_CACHE_MAX_FRAGS	16777216
+
+/*
+ * The largest region of a fragmented file that we are willing to
+ * rechunk in memory for a single write or truncate.  As fragments are
+ * at most SPLIT_MAX_FRAG_SIZE bytes, and zeroes that a file is extended
+ * by are never read into memory, this is only reached in files with
+ * fragments that predate that limit.
+ */
+#define REWRITE_MAX_BYTES	268435456
+
+/*
+ * Mapped fragments are shared between all open files.  Store
+ * fragments are identified by their content hash and length only
+ * (with start set to zero), so that a fragment that occurs in many
+ * recipe files, or many times in one, is cached once.  Fragments of
+ * fragmented files are identified by the fragment directory and the
+ * fragment's extent.  The same cache also holds decompressed copies
+ * of compressed store fragments, which are accounted against their
+ * own budget.
+ */
+struct splitfs_mapping_key {
+	dev_t			dev;
+	ino_t			ino;
 	uint64_t		start;
 	uint64_t		end;
+	uint8_t			hash[HASH_LENGTH];
+};
+
+/*
+ * The mapping cache is split into shards by key, each with its own
+ * lock, tree and CLOCK ring, so that readers of different fragments
+ * don't all serialise on one lock.  The byte budgets are global.
+ */
+#define MAPPING_SHARDS		16
+
+struct splitfs_mapping_shard {
+	pthread_mutex_t		lock;
+	struct iv_avl_tree	mappings;
+	struct iv_list_head	ring;
+	struct iv_list_head	*hand;
+	unsigned int		num;
+} __attribute__((aligned(64)));
+
+struct splitfs_mapping {
+	struct iv_avl_node	an;
+	struct iv_list_head	list;
+	struct splitfs_mapping_shard	*shard;
+	struct splitfs_mapping_key	key;
+	int			refcount;
+	int			dead;
+	int			referenced;
+	int			decompressed;
+	void			*addr;
+	size_t			length;
 };
 
 static int backing_dir_fd;
+static int store_dir_fd = -1;
+static unsigned int readahead_frags = 4;
+static int immutable;
+static int writable;
+static int passthrough = 1;
+static double cache_timeout = 1.0;
+static struct fuse_session *se;
+
+static pthread_mutex_t inodes_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct iv_avl_tree inodes;
+static struct splitfs_inode root_inode;
+
+static int inotify_fd = -1;
+static struct splitfs_inode **watches;
+static int watches_alloc;
+
+static pthread_mutex_t layouts_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct iv_avl_tree layouts;
+static struct iv_list_head layouts_lru;
+static uint64_t layouts_frags;
+
+static struct splitfs_mapping_shard mapping_shards[MAPPING_SHARDS];
+static unsigned int mapping_evict_shard;
+static uint64_t mappings_bytes;
+static uint64_t mappings_max_bytes;
+static uint64_t zcache_bytes;
+static uint64_t zcache_max_bytes = 64 << 20;
+static pthread_key_t dctx_key;
+
+/*
+ * We keep a count, total and maximum latency and a log2 latency
+ * histogram for each FUSE operation we care about and for each phase
+ * of serving a read from fragments, so that it can be told where the
+ * time goes.  They are readable from the virtual STATS_NAME file in
+ * the root of the mount, and are dumped to stderr (or to syslog, when
+ * daemonized) on SIGUSR1.
+ */
+#define STATS_NAME		".splitfs-stats"
+#define STATS_HIST_BUCKETS	64
+
+enum {
+	STAT_LOOKUP,
+	STAT_GETATTR,
+	STAT_OPEN,
+	STAT_READ,
+	STAT_WRITE,
+	STAT_READDIR,
+	STAT_READDIRPLUS,
+	STAT_COPY_FILE_RANGE,
+	STAT_FRAG_LOOKUP,
+	STAT_FRAG_OPEN,
+	STAT_FRAG_MAP,
+	STAT_FRAG_DECOMPRESS,
+	STAT_BACKING_IO,
+	NUM_STATS,
+};
+
+static const char *stat_names[NUM_STATS] = {
+	[STAT_LOOKUP]		= "lookup",
+	[STAT_GETATTR]		= "getattr",
+	[STAT_OPEN]		= "open",
+	[STAT_READ]		= "read",
+	[STAT_WRITE]		= "write",
+	[STAT_READDIR]		= "readdir",
+	[STAT_READDIRPLUS]	= "readdirplus",
+	[STAT_COPY_FILE_RANGE]	= "copy_file_range",
+	[STAT_FRAG_LOOKUP]	= "frag lookup",
+	[STAT_FRAG_OPEN]	= "frag open",
+	[STAT_FRAG_MAP]		= "frag mmap",
+	[STAT_FRAG_DECOMPRESS]	= "frag unzstd",
+	[STAT_BACKING_IO]	= "backing I/O",
+};
+
+struct splitfs_stat {
+	uint64_t		count;
+	uint64_t		total_ns;
+	uint64_t		max_ns;
+	uint64_t		hist[STATS_HIST_BUCKETS];
+};
+
+static struct splitfs_stat stats[NUM_STATS];
+static struct splitfs_inode stats_inode;
+
+static uint64_t stat_start(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stat_end(int id, uint64_t start)
+{
+	struct splitfs_stat *st = stats + id;
+	uint64_t ns;
+	uint64_t max;
+	int bucket;
+
+	ns = stat_start() - start;
+	bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	if (bucket >= STATS_HIST_BUCKETS)
+		bucket = STATS_HIST_BUCKETS - 1;
+
+	__atomic_fetch_add(&st->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&st->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&st->hist[bucket], 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&st->max_ns, __ATOMIC_RELAXED);
+	while (ns > max) {
+		if (__atomic_compare_exchange_n(&st->max_ns, &max, ns, 1,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+}
+
+/*
+ * Percentiles are estimated from the histogram, as the upper bound
+ * of the bucket that the requested sample falls into, capped at the
+ * maximum latency seen.
+ */
+static double stat_percentile(const struct splitfs_stat *st, int permille)
+{
+	uint64_t target;
+	uint64_t seen;
+	uint64_t ns;
+	int i;
+
+	target = (st->count * permille + 999) / 1000;
+
+	seen = 0;
+	for (i = 0; i < STATS_HIST_BUCKETS - 1; i++) {
+		seen += st->hist[i];
+		if (seen >= target)
+			break;
+	}
+
+	ns = 1ULL << i;
+	if (ns > st->max_ns)
+		ns = st->max_ns;
+
+	return (double)ns / 1000;
+}
+
+static void print_stats(FILE *fp)
+{
+	struct splitfs_stat snap[NUM_STATS];
+	int i;
+	int j;
+
+	for (i = 0; i < NUM_STATS; i++) {
+		snap[i].count = __atomic_load_n(&stats[i].count,
+						__ATOMIC_RELAXED);
+		snap[i].total_ns = __atomic_load_n(&stats[i].total_ns,
+						   __ATOMIC_RELAXED);
+		snap[i].max_ns = __atomic_load_n(&stats[i].max_ns,
+						 __ATOMIC_RELAXED);
+		for (j = 0; j < STATS_HIST_BUCKETS; j++) {
+			snap[i].hist[j] = __atomic_load_n(&stats[i].hist[j],
+							  __ATOMIC_RELAXED);
+		}
+	}
+
+	fprintf(fp, "%-12s %12s %10s %10s %10s %10s %10s\n", "op", "count",
+		"avg us", "p50 us", "p99 us", "p999 us", "max us");
+
+	for (i = 0; i < NUM_STATS; i++) {
+		struct splitfs_stat *st = snap + i;
+
+		if (st->count == 0)
+			continue;
+
+		fprintf(fp, "%-12s %12" PRIu64 " %10.1f %10.1f %10.1f "
+			"%10.1f %10.1f\n", stat_names[i], st->count,
+			(double)st->total_ns / st->count / 1000,
+			stat_percentile(st, 500), stat_percentile(st, 990),
+			stat_percentile(st, 999),
+			(double)st->max_ns / 1000);
+	}
+
+	for (i = 0; i < NUM_STATS; i++) {
+		struct splitfs_stat *st = snap + i;
+
+		if (st->count == 0)
+			continue;
+
+		fprintf(fp, "\n%s latency histogram:\n", stat_names[i]);
+		for (j = 0; j < STATS_HIST_BUCKETS; j++) {
+			if (st->hist[j] == 0)
+				continue;
+
+			fprintf(fp, "  < %12.3f us %12" PRIu64 "\n",
+				(double)(1ULL << j) / 1000, st->hist[j]);
+		}
+	}
+}
 
 static int is_fragmented_file_dir(int dirfd)
 {
@@ -120,112 +471,115 @@ out:
 	return ret;
 }
 
-static void file_size_handler(void *cookie, uint64_t start, uint64_t size)
+static ssize_t xpread(int fd, void *buf, size_t count, off_t offset)
 {
-	uint64_t *length = (uint64_t *)cookie;
-	uint64_t end;
+	off_t processed;
 
-	end = start + size;
-	if (end > *length)
-		*length = end;
-}
+	processed = 0;
+	while (processed < count) {
+		ssize_t ret;
 
-static int determine_fragmented_file_size(int dirfd, uint64_t *size)
-{
-	*size = 0;
+		do {
+			ret = pread(fd, buf, count - processed, offset);
+		} while (ret < 0 && errno == EINTR);
 
-	return iterate_fragmented_file_dir(dirfd, size, file_size_handler);
-}
+		if (ret <= 0) {
+			if (ret < 0)
+				perror("pread");
+			return processed ? processed : ret;
+		}
 
-static const char *empty_path(const char *path)
-{
-	return path[1] ? (path + 1) : ".";
+		buf += ret;
+		offset += ret;
+
+		processed += ret;
+	}
+
+	return processed;
 }
 
-static int splitfs_getattr(const char *path, struct stat *buf,
-			   struct fuse_file_info *fi)
+static ssize_t xpwrite(int fd, const void *buf, size_t count, off_t offset)
 {
-	int fd;
-	int ret;
-
-	if (path[0] != '/') {
-		fprintf(stderr, "getattr called with [%s]\n", path);
-		return -ENOENT;
-	}
+	off_t processed;
 
-	fd = openat(backing_dir_fd, empty_path(path), O_NOFOLLOW | O_RDONLY);
-	if (fd < 0)
-		return -errno;
+	processed = 0;
+	while (processed < count) {
+		ssize_t ret;
 
-	ret = fstat(fd, buf);
-	if (ret < 0) {
-		ret = -errno;
-		close(fd);
-		return ret;
-	}
+		do {
+			ret = pwrite(fd, buf, count - processed, offset);
+		} while (ret < 0 && errno == EINTR);
 
-	if ((buf->st_mode & S_IFMT) == S_IFDIR) {
-		ret = is_fragmented_file_dir(fd);
 		if (ret < 0) {
-			close(fd);
+			perror("pwrite");
 			return ret;
 		}
 
-		if (ret) {
-			uint64_t size;
-
-			ret = determine_fragmented_file_size(fd, &size);
-			if (ret < 0) {
-				close(fd);
-				return ret;
-			}
+		buf += ret;
+		offset += ret;
 
-			buf->st_mode &= ~(S_IFMT | 0111);
-			buf->st_mode |= S_IFREG;
-			buf->st_size = size;
-			buf->st_blocks = DIV_ROUND_UP(size, 512);
-		}
+		processed += ret;
 	}
 
-	close(fd);
-
-	return 0;
+	return processed;
 }
 
-static int splitfs_readlink(const char *path, char *buf, size_t bufsiz)
+static int read_recipe_header(int fd, struct recipe_header *hdr)
 {
-	int ret;
+	ssize_t ret;
 
-	if (path[0] != '/') {
-		fprintf(stderr, "readlink called with [%s]\n", path);
-		return -ENOENT;
-	}
+	if (store_dir_fd < 0)
+		return 0;
 
-	ret = readlinkat(backing_dir_fd, path + 1, buf, bufsiz);
+	ret = xpread(fd, hdr, sizeof(*hdr), 0);
 	if (ret < 0)
 		return -errno;
 
-	if (bufsiz && ret == bufsiz)
-		ret--;
-	buf[ret] = 0;
+	if (ret != sizeof(*hdr))
+		return 0;
 
-	return 0;
+	if (memcmp(hdr->magic, RECIPE_MAGIC, sizeof(hdr->magic)))
+		return 0;
+
+	return 1;
 }
 
-static int splitfs_truncate(const char *path, off_t length,
-			    struct fuse_file_info *fi)
+struct frag_table_builder {
+	struct splitfs_frag_table	*table;
+	uint64_t			alloc;
+};
+
+static void frag_table_handler(void *cookie, uint64_t start, uint64_t size)
 {
-	return -EINVAL;
+	struct frag_table_builder *b = cookie;
+	struct splitfs_frag_table *table = b->table;
+	struct fragindex_entry *frag;
+
+	if (table->num_frags == b->alloc) {
+		b->alloc *= 2;
+
+		table = realloc(table, sizeof(*table) +
+				       b->alloc * sizeof(table->frags[0]));
+		if (table == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		b->table = table;
+	}
+
+	frag = table->frags + table->num_frags++;
+	frag->start = start;
+	frag->end = start + size;
+
+	if (frag->end > table->size)
+		table->size = frag->end;
 }
 
-static int compare_file_fragments(const struct iv_avl_node *_a,
-				  const struct iv_avl_node *_b)
+static int compare_frags(const void *_a, const void *_b)
 {
-	struct splitfs_file_fragment *a;
-	struct splitfs_file_fragment *b;
-
-	a = iv_container_of(_a, struct splitfs_file_fragment, an);
-	b = iv_container_of(_b, struct splitfs_file_fragment, an);
+	const struct fragindex_entry *a = _a;
+	const struct fragindex_entry *b = _b;
 
 	if (a->start < b->start)
 		return -1;
@@ -235,122 +589,201 @@ static int compare_file_fragments(const struct iv_avl_node *_a,
 	return 0;
 }
 
-static void file_frag_handler(void *cookie, uint64_t start, uint64_t size)
+static int timespec_before(const struct timespec *a, const struct timespec *b)
 {
-	struct splitfs_file_info *fh = cookie;
-	struct splitfs_file_fragment *frag;
-
-	frag = malloc(sizeof(*frag));
-	if (frag == NULL) {
-		fprintf(stderr, "out of memory\n");
-		exit(EXIT_FAILURE);
-	}
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
 
-	frag->start = start;
-	frag->end = start + size;
-	iv_avl_tree_insert(&fh->fragments, &frag->an);
+	return a->tv_nsec < b->tv_nsec;
+}
 
-	if (frag->end > fh->size)
-		fh->size = frag->end;
+static int timespec_equal(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
 }
 
-static void __free_file_fragment(struct iv_avl_node *an)
+/*
+ * The index is only used if its entries describe a valid layout:
+ * sorted, non-overlapping (with gaps allowed) fragments starting at
+ * offset zero and ending at the end of the file.  Only an empty file
+ * has an empty fragment.
+ */
+static int valid_fragindex(const struct splitfs_frag_table *table)
 {
-	struct splitfs_file_fragment *frag;
+	const struct fragindex_entry *frags = table->frags;
+	uint64_t num = table->num_frags;
+	uint64_t i;
 
-	frag = iv_container_of(an, struct splitfs_file_fragment, an);
+	if (num == 0 || frags[0].start != 0)
+		return 0;
 
-	if (an->left != NULL)
-		__free_file_fragment(an->left);
-	if (an->right != NULL)
-		__free_file_fragment(an->right);
-	free(frag);
-}
+	if (num == 1 && table->size == 0)
+		return frags[0].end == 0;
 
-static void free_splitfs_file_info(struct splitfs_file_info *fh)
-{
-	close(fh->fd);
-	if (fh->is_fragmented_file && fh->fragments.root != NULL)
-		__free_file_fragment(fh->fragments.root);
-	free(fh);
+	for (i = 0; i < num; i++) {
+		if (frags[i].start >= frags[i].end)
+			return 0;
+
+		if (i + 1 < num && frags[i].end > frags[i + 1].start)
+			return 0;
+	}
+
+	return frags[num - 1].end == table->size;
 }
 
-static int splitfs_open(const char *path, struct fuse_file_info *fi)
+static struct splitfs_frag_table *
+load_fragindex(int dirfd, const struct stat *dirbuf)
 {
 	int fd;
 	struct stat buf;
-	int ret;
-	struct splitfs_file_info *fh;
+	struct fragindex_header hdr;
+	size_t length;
+	struct splitfs_frag_table *table;
+
+	fd = openat(dirfd, FRAGINDEX_NAME, O_RDONLY);
+	if (fd < 0)
+		return NULL;
 
-	if (path[0] != '/') {
-		fprintf(stderr, "open called with [%s]\n", path);
-		return -ENOENT;
+	if (fstat(fd, &buf) < 0 ||
+	    timespec_before(&buf.st_mtim, &dirbuf->st_mtim)) {
+		close(fd);
+		return NULL;
 	}
 
-	if ((fi->flags & O_ACCMODE) != O_RDONLY)
-		return -EACCES;
+	if (xpread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.magic, FRAGINDEX_MAGIC, sizeof(hdr.magic))) {
+		close(fd);
+		return NULL;
+	}
 
-	fd = openat(backing_dir_fd, empty_path(path), O_RDONLY);
-	if (fd < 0)
-		return -errno;
+	if (hdr.num_entries > (SIZE_MAX - sizeof(hdr) - sizeof(*table)) /
+			      sizeof(table->frags[0])) {
+		close(fd);
+		return NULL;
+	}
 
-	ret = fstat(fd, &buf);
-	if (ret < 0) {
+	length = hdr.num_entries * sizeof(table->frags[0]);
+	if (buf.st_size != sizeof(hdr) + length) {
 		close(fd);
-		return -errno;
+		return NULL;
 	}
 
-	fh = malloc(sizeof(*fh));
-	if (fh == NULL) {
+	table = malloc(sizeof(*table) + length);
+	if (table == NULL) {
 		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (xpread(fd, table->frags, length, sizeof(hdr)) != length) {
+		free(table);
 		close(fd);
-		return -ENOMEM;
+		return NULL;
 	}
 
-	fh->fd = fd;
-	fh->is_fragmented_file = 0;
+	close(fd);
 
-	if ((buf.st_mode & S_IFMT) == S_IFDIR) {
-		ret = is_fragmented_file_dir(fd);
-		if (ret < 0) {
-			free_splitfs_file_info(fh);
-			return ret;
-		}
+	table->size = hdr.file_size;
+	table->num_frags = hdr.num_entries;
 
-		if (ret) {
-			fh->is_fragmented_file = 1;
-			INIT_IV_AVL_TREE(&fh->fragments,
-					 compare_file_fragments);
-			fh->size = 0;
+	if (!valid_fragindex(table)) {
+		fprintf(stderr, "ignoring invalid fragment index\n");
+		free(table);
+		return NULL;
+	}
 
-			ret = iterate_fragmented_file_dir(fd, fh,
-							  file_frag_handler);
-			if (ret < 0) {
-				free_splitfs_file_info(fh);
-				return ret;
-			}
-		}
+	return table;
+}
+
+static int build_frag_table(int dirfd, const struct stat *dirbuf,
+			    struct splitfs_frag_table **ptable)
+{
+	struct frag_table_builder b;
+	uint64_t i;
+	int ret;
+
+	b.table = load_fragindex(dirfd, dirbuf);
+	if (b.table != NULL) {
+		b.table->refcount = 1;
+		*ptable = b.table;
+		return 0;
 	}
 
-	fi->fh = (int64_t)fh;
+	b.alloc = 64;
+	b.table = malloc(sizeof(*b.table) +
+			 b.alloc * sizeof(b.table->frags[0]));
+	if (b.table == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	b.table->refcount = 1;
+	b.table->size = 0;
+	b.table->num_frags = 0;
+
+	ret = iterate_fragmented_file_dir(dirfd, &b, frag_table_handler);
+	if (ret < 0) {
+		free(b.table);
+		return ret;
+	}
+
+	qsort(b.table->frags, b.table->num_frags, sizeof(b.table->frags[0]),
+	      compare_frags);
+
+	/*
+	 * A rewrite that was interrupted after renaming its new
+	 * fragments into place leaves some of the old fragments that
+	 * they replace behind (see rewrite_fragments()).  Both the old
+	 * and the new fragments cover the rewritten range without gaps,
+	 * so cutting every fragment short at the start of the next one
+	 * gives each byte of the range either its old or its new
+	 * contents.
+	 */
+	for (i = 1; i < b.table->num_frags; i++) {
+		struct fragindex_entry *frag = b.table->frags + i;
+
+		if (frag[-1].end > frag->start)
+			frag[-1].end = frag->start;
+	}
+
+	*ptable = b.table;
 
 	return 0;
 }
 
-static struct splitfs_file_fragment *
-find_fragment(struct splitfs_file_info *fh, uint64_t offset)
+static int compare_layouts(const struct iv_avl_node *_a,
+			   const struct iv_avl_node *_b)
+{
+	const struct splitfs_layout *a;
+	const struct splitfs_layout *b;
+
+	a = iv_container_of(_a, struct splitfs_layout, an);
+	b = iv_container_of(_b, struct splitfs_layout, an);
+
+	if (a->dev < b->dev)
+		return -1;
+	if (a->dev > b->dev)
+		return 1;
+	if (a->ino < b->ino)
+		return -1;
+	if (a->ino > b->ino)
+		return 1;
+
+	return 0;
+}
+
+static struct splitfs_layout *find_layout(dev_t dev, ino_t ino)
 {
 	struct iv_avl_node *an;
 
-	an = fh->fragments.root;
+	an = layouts.root;
 	while (an != NULL) {
-		struct splitfs_file_fragment *frag;
+		struct splitfs_layout *l;
 
-		frag = iv_container_of(an, struct splitfs_file_fragment, an);
-		if (offset < frag->start)
+		l = iv_container_of(an, struct splitfs_layout, an);
+		if (dev < l->dev || (dev == l->dev && ino < l->ino))
 			an = an->left;
-		else if (offset < frag->end)
-			return frag;
+		else if (dev == l->dev && ino == l->ino)
+			return l;
 		else
 			an = an->right;
 	}
@@ -358,188 +791,3762 @@ find_fragment(struct splitfs_file_info *fh, uint64_t offset)
 	return NULL;
 }
 
-static ssize_t xpread(int fd, void *buf, size_t count, off_t offset)
+static void __put_frag_table(struct splitfs_frag_table *table)
 {
-	off_t processed;
-
-	processed = 0;
-	while (processed < count) {
-		ssize_t ret;
+	if (!--table->refcount)
+		free(table);
+}
 
-		do {
-			ret = pread(fd, buf, count - processed, offset);
-		} while (ret < 0 && errno == EINTR);
+static void put_frag_table(struct splitfs_frag_table *table)
+{
+	pthread_mutex_lock(&layouts_lock);
+	__put_frag_table(table);
+	pthread_mutex_unlock(&layouts_lock);
+}
 
-		if (ret <= 0) {
-			if (ret < 0)
-				perror("pread");
-			return processed ? processed : ret;
-		}
+static void __evict_layouts(struct splitfs_layout *keep)
+{
+	while (layouts_frags > LAYOUT_CACHE_MAX_FRAGS) {
+		struct splitfs_layout *l;
 
-		buf += ret;
-		offset += ret;
+		l = iv_list_entry(layouts_lru.prev,
+				  struct splitfs_layout, list);
+		if (l == keep)
+			break;
 
-		processed += ret;
+		iv_avl_tree_delete(&layouts, &l->an);
+		iv_list_del(&l->list);
+		layouts_frags -= l->table->num_frags;
+		__put_frag_table(l->table);
+		free(l);
 	}
-
-	return processed;
 }
 
-static int splitfs_read(const char *path, char *buf, size_t size,
-			off_t offset, struct fuse_file_info *fi)
+/*
+ * Make table the cached layout of the fragment directory described
+ * by dirbuf, taking over the caller's reference to it.
+ */
+static void __install_layout(const struct stat *dirbuf,
+			     struct splitfs_frag_table *table)
 {
-	struct splitfs_file_info *fh = (void *)fi->fh;
-	ssize_t processed;
+	struct splitfs_layout *l;
+
+	l = find_layout(dirbuf->st_dev, dirbuf->st_ino);
+	if (l == NULL) {
+		l = malloc(sizeof(*l));
+		if (l == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		l->dev = dirbuf->st_dev;
+		l->ino = dirbuf->st_ino;
+		iv_avl_tree_insert(&layouts, &l->an);
+	} else {
+		iv_list_del(&l->list);
+		layouts_frags -= l->table->num_frags;
+		__put_frag_table(l->table);
+	}
+
+	l->mtime = dirbuf->st_mtim;
+	l->ctime = dirbuf->st_ctim;
+	l->table = table;
+	iv_list_add(&l->list, &layouts_lru);
+	layouts_frags += table->num_frags;
+
+	__evict_layouts(l);
+}
+
+static int get_frag_table(int dirfd, const struct stat *dirbuf,
+			  struct splitfs_frag_table **ptable)
+{
+	struct splitfs_layout *l;
+	struct splitfs_frag_table *table;
+	int ret;
+
+	pthread_mutex_lock(&layouts_lock);
+
+	l = find_layout(dirbuf->st_dev, dirbuf->st_ino);
+	if (l != NULL && timespec_equal(&l->mtime, &dirbuf->st_mtim) &&
+	    timespec_equal(&l->ctime, &dirbuf->st_ctim)) {
+		iv_list_del(&l->list);
+		iv_list_add(&l->list, &layouts_lru);
+
+		l->table->refcount++;
+		*ptable = l->table;
+
+		pthread_mutex_unlock(&layouts_lock);
+
+		return 0;
+	}
+
+	pthread_mutex_unlock(&layouts_lock);
+
+	ret = build_frag_table(dirfd, dirbuf, &table);
+	if (ret < 0)
+		return ret;
+
+	pthread_mutex_lock(&layouts_lock);
+
+	__install_layout(dirbuf, table);
+
+	table->refcount++;
+	*ptable = table;
+
+	pthread_mutex_unlock(&layouts_lock);
+
+	return 0;
+}
+
+static void init_inode(struct splitfs_inode *inode)
+{
+	pthread_rwlockattr_t attr;
+
+	/*
+	 * Readers hold the lock for the duration of every read, so
+	 * make sure that writers don't starve.
+	 */
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&inode->rwlock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	INIT_IV_LIST_HEAD(&inode->open_files);
+	inode->wd = -1;
+}
+
+static int compare_inodes(const struct iv_avl_node *_a,
+			  const struct iv_avl_node *_b)
+{
+	const struct splitfs_inode *a;
+	const struct splitfs_inode *b;
+
+	a = iv_container_of(_a, struct splitfs_inode, an);
+	b = iv_container_of(_b, struct splitfs_inode, an);
+
+	if (a->dev < b->dev)
+		return -1;
+	if (a->dev > b->dev)
+		return 1;
+	if (a->ino < b->ino)
+		return -1;
+	if (a->ino > b->ino)
+		return 1;
+
+	return 0;
+}
+
+static struct splitfs_inode *find_inode(dev_t dev, ino_t ino)
+{
+	struct iv_avl_node *an;
+
+	an = inodes.root;
+	while (an != NULL) {
+		struct splitfs_inode *inode;
+
+		inode = iv_container_of(an, struct splitfs_inode, an);
+		if (dev < inode->dev || (dev == inode->dev && ino < inode->ino))
+			an = an->left;
+		else if (dev == inode->dev && ino == inode->ino)
+			return inode;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+static struct splitfs_inode *get_inode(fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return &root_inode;
+
+	return (struct splitfs_inode *)(uintptr_t)ino;
+}
+
+static int reopen_inode(struct splitfs_inode *inode, int flags)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", inode->fd);
+
+	return open(path, flags);
+}
+
+static int inode_recipe_size(struct splitfs_inode *inode,
+			     const struct stat *buf, uint64_t *size)
+{
+	struct recipe_header hdr;
+	int fd;
+	int ret;
+
+	pthread_mutex_lock(&inodes_lock);
+
+	if (inode->recipe_valid &&
+	    timespec_equal(&inode->recipe_ctime, &buf->st_ctim)) {
+		ret = inode->is_recipe;
+		*size = inode->recipe_size;
+
+		pthread_mutex_unlock(&inodes_lock);
+
+		return ret;
+	}
+
+	pthread_mutex_unlock(&inodes_lock);
+
+	fd = reopen_inode(inode, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	ret = read_recipe_header(fd, &hdr);
+	close(fd);
+
+	if (ret < 0)
+		return ret;
+
+	*size = ret ? hdr.file_size : 0;
+
+	pthread_mutex_lock(&inodes_lock);
+	inode->recipe_valid = 1;
+	inode->recipe_ctime = buf->st_ctim;
+	inode->is_recipe = ret;
+	inode->recipe_size = *size;
+	pthread_mutex_unlock(&inodes_lock);
+
+	return ret;
+}
+
+/*
+ * Present fragment directories and recipe files as regular files
+ * of the size that they describe.
+ */
+static int masquerade_attr(struct splitfs_inode *inode, struct stat *buf)
+{
+	uint64_t size;
+	int ret;
+
+	if ((buf->st_mode & S_IFMT) == S_IFDIR) {
+		struct splitfs_frag_table *table;
+
+		ret = is_fragmented_file_dir(inode->fd);
+		if (ret <= 0)
+			return ret;
+
+		/*
+		 * Don't look at the fragment directory while a write
+		 * is rearranging it.
+		 */
+		if (writable)
+			pthread_rwlock_rdlock(&inode->rwlock);
+		ret = get_frag_table(inode->fd, buf, &table);
+		if (writable)
+			pthread_rwlock_unlock(&inode->rwlock);
+		if (ret < 0)
+			return ret;
+
+		size = table->size;
+		put_frag_table(table);
+
+		buf->st_mode &= ~(S_IFMT | 0111);
+		buf->st_mode |= S_IFREG;
+	} else if ((buf->st_mode & S_IFMT) == S_IFREG) {
+		ret = inode_recipe_size(inode, buf, &size);
+		if (ret <= 0)
+			return ret;
+
+		buf->st_mode &= ~0111;
+	} else {
+		return 0;
+	}
+
+	buf->st_size = size;
+	buf->st_blocks = DIV_ROUND_UP(size, 512);
+
+	return 0;
+}
+
+static int inode_stat(struct splitfs_inode *inode, struct stat *buf)
+{
+	int ret;
+
+	ret = fstatat(inode->fd, "", buf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+	if (ret < 0)
+		return -errno;
+
+	return masquerade_attr(inode, buf);
+}
+
+/*
+ * In immutable mode, the kernel is allowed to cache data, attributes
+ * and directory entries for a long time.  As a safety net, we watch
+ * every backing directory that the kernel knows about with inotify,
+ * and tell the kernel to drop whatever it has cached for things that
+ * change underneath us.
+ */
+static void watch_inode(struct splitfs_inode *inode)
+{
+	char path[64];
+	int wd;
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", inode->fd);
+
+	wd = inotify_add_watch(inotify_fd, path,
+			       IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE |
+			       IN_DELETE | IN_MODIFY | IN_MOVED_FROM |
+			       IN_MOVED_TO | IN_ONLYDIR);
+	if (wd < 0) {
+		perror("inotify_add_watch");
+		return;
+	}
+
+	pthread_mutex_lock(&inodes_lock);
+
+	if (wd >= watches_alloc) {
+		int alloc;
+
+		alloc = watches_alloc ? 2 * watches_alloc : 1024;
+		while (alloc <= wd)
+			alloc *= 2;
+
+		watches = realloc(watches, alloc * sizeof(*watches));
+		if (watches == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		memset(watches + watches_alloc, 0,
+		       (alloc - watches_alloc) * sizeof(*watches));
+		watches_alloc = alloc;
+	}
+
+	watches[wd] = inode;
+	inode->wd = wd;
+
+	pthread_mutex_unlock(&inodes_lock);
+}
+
+static fuse_ino_t inode_number(struct splitfs_inode *inode)
+{
+	if (inode == &root_inode)
+		return FUSE_ROOT_ID;
+
+	return (uintptr_t)inode;
+}
+
+static void forget_inode(struct splitfs_inode *inode, uint64_t nlookup)
+{
+	int wd;
+
+	if (inode == &root_inode || inode == &stats_inode)
+		return;
+
+	pthread_mutex_lock(&inodes_lock);
+
+	inode->nlookup -= nlookup;
+	if (inode->nlookup) {
+		pthread_mutex_unlock(&inodes_lock);
+		return;
+	}
+
+	iv_avl_tree_delete(&inodes, &inode->an);
+
+	wd = inode->wd;
+	if (wd >= 0)
+		watches[wd] = NULL;
+
+	pthread_mutex_unlock(&inodes_lock);
+
+	if (wd >= 0)
+		inotify_rm_watch(inotify_fd, wd);
+
+	close(inode->fd);
+	pthread_rwlock_destroy(&inode->rwlock);
+	free(inode);
+}
+
+static int do_lookup(struct splitfs_inode *dir, const char *name,
+		     struct fuse_entry_param *e)
+{
+	struct splitfs_inode *inode;
+	int watch;
+	int fd;
+	int ret;
+
+	fd = openat(dir->fd, name, O_PATH | O_NOFOLLOW);
+	if (fd < 0)
+		return -errno;
+
+	memset(e, 0, sizeof(*e));
+
+	ret = fstatat(fd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+	if (ret < 0) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	watch = 0;
+
+	pthread_mutex_lock(&inodes_lock);
+
+	inode = find_inode(e->attr.st_dev, e->attr.st_ino);
+	if (inode != NULL) {
+		inode->nlookup++;
+		close(fd);
+	} else {
+		inode = calloc(1, sizeof(*inode));
+		if (inode == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		init_inode(inode);
+		inode->fd = fd;
+		inode->dev = e->attr.st_dev;
+		inode->ino = e->attr.st_ino;
+		inode->nlookup = 1;
+		iv_avl_tree_insert(&inodes, &inode->an);
+
+		if (inotify_fd >= 0 && S_ISDIR(e->attr.st_mode))
+			watch = 1;
+	}
+
+	pthread_mutex_unlock(&inodes_lock);
+
+	if (watch)
+		watch_inode(inode);
+
+	ret = masquerade_attr(inode, &e->attr);
+	if (ret < 0) {
+		/*
+		 * The kernel only learns about the inode if we reply
+		 * with an entry, so drop the reference we just took.
+		 */
+		forget_inode(inode, 1);
+		return ret;
+	}
+
+	e->ino = (uintptr_t)inode;
+	e->attr_timeout = cache_timeout;
+	e->entry_timeout = cache_timeout;
+
+	return 0;
+}
+
+static void stats_attr(struct stat *buf)
+{
+	memset(buf, 0, sizeof(*buf));
+	buf->st_ino = 1;
+	buf->st_mode = S_IFREG | 0444;
+	buf->st_nlink = 1;
+}
+
+static void splitfs_lookup(fuse_req_t req, fuse_ino_t parent,
+			   const char *name)
+{
+	uint64_t start = stat_start();
+	struct fuse_entry_param e;
+	int ret;
+
+	if (parent == FUSE_ROOT_ID && !strcmp(name, STATS_NAME)) {
+		memset(&e, 0, sizeof(e));
+		e.ino = (uintptr_t)&stats_inode;
+		stats_attr(&e.attr);
+		fuse_reply_entry(req, &e);
+		stat_end(STAT_LOOKUP, start);
+		return;
+	}
+
+	ret = do_lookup(get_inode(parent), name, &e);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_entry(req, &e);
+
+	stat_end(STAT_LOOKUP, start);
+}
+
+static void splitfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	forget_inode(get_inode(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+static void splitfs_forget_multi(fuse_req_t req, size_t count,
+				 struct fuse_forget_data *forgets)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		forget_inode(get_inode(forgets[i].ino),
+			     forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+static void splitfs_getattr(fuse_req_t req, fuse_ino_t ino,
+			    struct fuse_file_info *fi)
+{
+	struct splitfs_inode *inode = get_inode(ino);
+	uint64_t start = stat_start();
+	struct stat buf;
+	int ret;
+
+	if (inode == &stats_inode) {
+		stats_attr(&buf);
+		fuse_reply_attr(req, &buf, 0);
+		stat_end(STAT_GETATTR, start);
+		return;
+	}
+
+	ret = inode_stat(inode, &buf);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_attr(req, &buf, cache_timeout);
+
+	stat_end(STAT_GETATTR, start);
+}
+
+static void splitfs_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	struct splitfs_inode *inode = get_inode(ino);
+	char buf[PATH_MAX + 1];
+	int ret;
+
+	ret = readlinkat(inode->fd, "", buf, sizeof(buf));
+	if (ret < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	if (ret == sizeof(buf)) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+	buf[ret] = 0;
+
+	fuse_reply_readlink(req, buf);
+}
+
+static int truncate_file(struct splitfs_inode *inode,
+			 struct splitfs_file_info *fh, uint64_t size);
+
+/*
+ * The only attribute that can be changed is the file size, and
+ * only in writable mode.  Timestamp updates that come along with a
+ * truncate are ignored.
+ */
+static void splitfs_setattr(fuse_req_t req, fuse_ino_t ino,
+			    struct stat *attr, int to_set,
+			    struct fuse_file_info *fi)
+{
+	struct splitfs_inode *inode = get_inode(ino);
+	struct stat buf;
+	int ret;
+
+	if (!writable || !(to_set & FUSE_SET_ATTR_SIZE) ||
+	    inode == &stats_inode) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	if (attr->st_size < 0) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	ret = truncate_file(inode, fi ? (void *)fi->fh : NULL, attr->st_size);
+	if (ret == 0)
+		ret = inode_stat(inode, &buf);
+
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	fuse_reply_attr(req, &buf, cache_timeout);
+}
+
+static void unlist_file_info(struct splitfs_file_info *fh);
+
+static void free_splitfs_file_info(struct splitfs_file_info *fh)
+{
+	int i;
+
+	for (i = 0; i < FD_CACHE_SIZE; i++) {
+		if (fh->fd_cache[i].fd >= 0)
+			close(fh->fd_cache[i].fd);
+	}
+	pthread_mutex_destroy(&fh->fd_cache_lock);
+
+	if (fh->inode != NULL)
+		unlist_file_info(fh);
+
+	free(fh->stats);
+	if (fh->fd >= 0)
+		close(fh->fd);
+	if (fh->is_fragmented_file)
+		put_frag_table(fh->table);
+	if (fh->is_recipe_file)
+		munmap(fh->recipe_map, fh->recipe_map_length);
+	free(fh);
+}
+
+static int map_recipe_file(struct splitfs_file_info *fh, struct stat *buf)
+{
+	const struct recipe_header *hdr;
+	uint64_t entries;
+
+	if (buf->st_size < sizeof(*hdr))
+		return -EIO;
+
+	fh->recipe_map_length = buf->st_size;
+
+	fh->recipe_map = mmap(NULL, fh->recipe_map_length, PROT_READ,
+			      MAP_SHARED, fh->fd, 0);
+	if (fh->recipe_map == MAP_FAILED) {
+		perror("mmap");
+		return -errno;
+	}
+
+	fh->is_recipe_file = 1;
+
+	hdr = fh->recipe_map;
+
+	entries = (buf->st_size - sizeof(*hdr)) / sizeof(struct recipe_entry);
+	if (hdr->num_entries != entries) {
+		fprintf(stderr, "recipe has %" PRId64 " entries, "
+				"expected %" PRId64 "\n",
+			hdr->num_entries, entries);
+		return -EIO;
+	}
+
+	fh->recipe = (const struct recipe_entry *)(hdr + 1);
+	fh->recipe_entries = entries;
+	fh->size = hdr->file_size;
+
+	return 0;
+}
+
+static int open_file_info(struct splitfs_inode *inode,
+			  struct fuse_file_info *fi)
+{
+	int fd;
+	struct stat buf;
+	int ret;
+	struct splitfs_file_info *fh;
+	int i;
+
+	fd = reopen_inode(inode, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	ret = fstat(fd, &buf);
+	if (ret < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	fh = malloc(sizeof(*fh));
+	if (fh == NULL) {
+		fprintf(stderr, "out of memory\n");
+		close(fd);
+		return -ENOMEM;
+	}
+
+	fh->stats = NULL;
+	fh->stats_length = 0;
+	fh->inode = NULL;
+	fh->writable = (fi->flags & O_ACCMODE) != O_RDONLY;
+	fh->fd = fd;
+	fh->dev = buf.st_dev;
+	fh->ino = buf.st_ino;
+	fh->is_plain_file = 0;
+	fh->backing_id = 0;
+	fh->is_fragmented_file = 0;
+	fh->cursor = 0;
+	fh->next_offset = 0;
+	fh->prefetch_start = 0;
+	fh->prefetched = 0;
+	fh->is_recipe_file = 0;
+
+	pthread_mutex_init(&fh->fd_cache_lock, NULL);
+	fh->fd_cache_clock = 0;
+	for (i = 0; i < FD_CACHE_SIZE; i++)
+		fh->fd_cache[i].fd = -1;
+
+	if ((buf.st_mode & S_IFMT) == S_IFDIR) {
+		ret = is_fragmented_file_dir(fd);
+		if (ret < 0) {
+			free_splitfs_file_info(fh);
+			return ret;
+		}
+
+		if (ret == 0 && fh->writable) {
+			free_splitfs_file_info(fh);
+			return -EISDIR;
+		}
+
+		if (ret) {
+			/*
+			 * In writable mode, all open files of an inode
+			 * share its current fragment table, which writes
+			 * replace under the inode lock.
+			 */
+			if (writable)
+				pthread_rwlock_wrlock(&inode->rwlock);
+
+			ret = get_frag_table(fd, &buf, &fh->table);
+			if (ret == 0 && writable) {
+				fh->inode = inode;
+				iv_list_add_tail(&fh->list, &inode->open_files);
+			}
+
+			if (writable)
+				pthread_rwlock_unlock(&inode->rwlock);
+
+			if (ret < 0) {
+				free_splitfs_file_info(fh);
+				return ret;
+			}
+
+			fh->is_fragmented_file = 1;
+			fh->size = fh->table->size;
+		}
+	} else if ((buf.st_mode & S_IFMT) == S_IFREG) {
+		struct recipe_header hdr;
+
+		ret = read_recipe_header(fd, &hdr);
+		if (ret > 0) {
+			ret = fh->writable ? -EROFS : map_recipe_file(fh, &buf);
+		} else if (ret == 0 && fh->writable) {
+			fd = reopen_inode(inode, fi->flags & O_ACCMODE);
+			if (fd < 0) {
+				ret = -errno;
+			} else {
+				close(fh->fd);
+				fh->fd = fd;
+			}
+		}
+		if (ret < 0) {
+			free_splitfs_file_info(fh);
+			return ret;
+		}
+
+		fh->is_plain_file = !fh->is_recipe_file;
+	}
+
+	fi->fh = (int64_t)fh;
+
+	return 0;
+}
+
+/*
+ * The statistics file is snapshotted at open time, and is opened
+ * with direct I/O so that the kernel reads it regardless of its
+ * reported size of zero.
+ */
+static int open_stats_file(struct fuse_file_info *fi)
+{
+	struct splitfs_file_info *fh;
+	FILE *fp;
+	int i;
+
+	fh = calloc(1, sizeof(*fh));
+	if (fh == NULL)
+		return -ENOMEM;
+
+	fh->fd = -1;
+	pthread_mutex_init(&fh->fd_cache_lock, NULL);
+	for (i = 0; i < FD_CACHE_SIZE; i++)
+		fh->fd_cache[i].fd = -1;
+
+	fp = open_memstream(&fh->stats, &fh->stats_length);
+	if (fp == NULL) {
+		free_splitfs_file_info(fh);
+		return -ENOMEM;
+	}
+	print_stats(fp);
+	fclose(fp);
+
+	fi->fh = (int64_t)fh;
+	fi->direct_io = 1;
+
+	return 0;
+}
+
+/*
+ * Plain files have nothing for us to do on the data path, so on
+ * kernels that support it, we hand their backing fd to the kernel
+ * and let it do reads and writes on it directly, without going
+ * through us at all.  If the kernel refuses (typically because we
+ * lack CAP_SYS_ADMIN), we stop trying and serve plain files
+ * ourselves, as before.
+ */
+static void open_passthrough(fuse_req_t req, struct splitfs_file_info *fh,
+			     struct fuse_file_info *fi)
+{
+#ifdef FUSE_CAP_PASSTHROUGH
+	int backing_id;
+
+	if (!passthrough || !fh->is_plain_file)
+		return;
+
+	backing_id = fuse_passthrough_open(req, fh->fd);
+	if (backing_id <= 0) {
+		fprintf(stderr, "passthrough unavailable, serving plain "
+				"files through splitfs\n");
+		passthrough = 0;
+		return;
+	}
+
+	fh->backing_id = backing_id;
+	fi->backing_id = backing_id;
+#endif
+}
+
+static void splitfs_open(fuse_req_t req, fuse_ino_t ino,
+			 struct fuse_file_info *fi)
+{
+	struct splitfs_inode *inode = get_inode(ino);
+	uint64_t start = stat_start();
+	int ret;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY &&
+	    (!writable || inode == &stats_inode)) {
+		fuse_reply_err(req, EACCES);
+		stat_end(STAT_OPEN, start);
+		return;
+	}
+
+	if (inode == &stats_inode)
+		ret = open_stats_file(fi);
+	else
+		ret = open_file_info(inode, fi);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		stat_end(STAT_OPEN, start);
+		return;
+	}
+
+	if (immutable && inode != &stats_inode)
+		fi->keep_cache = 1;
+
+	open_passthrough(req, (void *)fi->fh, fi);
+
+	fuse_reply_open(req, fi);
+
+	stat_end(STAT_OPEN, start);
+}
+
+/*
+ * Fragment lookups first try the fragment found by the previous
+ * lookup on this file and the one following it, which makes
+ * sequential reads O(1) per chunk.  Otherwise, we binary search
+ * the sorted fragment array, with the first probe interpolated
+ * from the offset, since fragments are roughly equally sized.
+ */
+static uint64_t interpolate(uint64_t offset, uint64_t size, uint64_t num)
+{
+	if (!size)
+		return 0;
+
+	return ((unsigned __int128)offset * num) / size;
+}
+
+static const struct fragindex_entry *
+find_fragment(struct splitfs_file_info *fh, uint64_t offset)
+{
+	const struct splitfs_frag_table *table = fh->table;
+	const struct fragindex_entry *frag;
+	uint64_t lo;
+	uint64_t hi;
+	uint64_t mid;
+
+	mid = __atomic_load_n(&fh->cursor, __ATOMIC_RELAXED);
+	if (mid < table->num_frags && offset >= table->frags[mid].start) {
+		frag = table->frags + mid;
+		if (offset < frag->end)
+			return frag;
+
+		if (mid + 1 < table->num_frags && offset >= frag[1].start &&
+		    offset < frag[1].end) {
+			__atomic_store_n(&fh->cursor, mid + 1,
+					 __ATOMIC_RELAXED);
+			return frag + 1;
+		}
+	}
+
+	lo = 0;
+	hi = table->num_frags;
+	mid = interpolate(offset, table->size, table->num_frags);
+	while (lo < hi) {
+		if (mid < lo || mid >= hi)
+			mid = lo + (hi - lo) / 2;
+
+		frag = table->frags + mid;
+		if (offset < frag->start) {
+			hi = mid;
+		} else if (offset < frag->end) {
+			__atomic_store_n(&fh->cursor, mid, __ATOMIC_RELAXED);
+			return frag;
+		} else {
+			lo = mid + 1;
+		}
+
+		mid = lo + (hi - lo) / 2;
+	}
+
+	return NULL;
+}
+
+static const struct recipe_entry *
+find_recipe_entry(struct splitfs_file_info *fh, uint64_t offset)
+{
+	const struct recipe_entry *ent;
+	uint64_t lo;
+	uint64_t hi;
+	uint64_t mid;
+
+	mid = __atomic_load_n(&fh->cursor, __ATOMIC_RELAXED);
+	if (mid < fh->recipe_entries && offset >= fh->recipe[mid].start) {
+		ent = fh->recipe + mid;
+		if (offset - ent->start < ent->length)
+			return ent;
+
+		if (mid + 1 < fh->recipe_entries && offset >= ent[1].start &&
+		    offset - ent[1].start < ent[1].length) {
+			__atomic_store_n(&fh->cursor, mid + 1,
+					 __ATOMIC_RELAXED);
+			return ent + 1;
+		}
+	}
+
+	lo = 0;
+	hi = fh->recipe_entries;
+	mid = interpolate(offset, fh->size, fh->recipe_entries);
+	while (lo < hi) {
+		if (mid < lo || mid >= hi)
+			mid = lo + (hi - lo) / 2;
+
+		ent = fh->recipe + mid;
+		if (offset < ent->start) {
+			hi = mid;
+		} else if (offset - ent->start < ent->length) {
+			__atomic_store_n(&fh->cursor, mid, __ATOMIC_RELAXED);
+			return ent;
+		} else {
+			lo = mid + 1;
+		}
+
+		mid = lo + (hi - lo) / 2;
+	}
+
+	return NULL;
+}
+
+static int find_fragment_extent(struct splitfs_file_info *fh, uint64_t offset,
+				uint64_t *start, uint64_t *end)
+{
+	uint64_t stat = stat_start();
+	int ret;
+
+	ret = 0;
+	if (fh->is_recipe_file) {
+		const struct recipe_entry *ent;
+
+		ent = find_recipe_entry(fh, offset);
+		if (ent != NULL) {
+			*start = ent->start;
+			*end = ent->start + ent->length;
+		} else {
+			ret = -1;
+		}
+	} else {
+		const struct fragindex_entry *frag;
+
+		frag = find_fragment(fh, offset);
+		if (frag != NULL) {
+			*start = frag->start;
+			*end = frag->end;
+		} else {
+			ret = -1;
+		}
+	}
+
+	stat_end(STAT_FRAG_LOOKUP, stat);
+
+	return ret;
+}
+
+/*
+ * Without a fragment index, the layout of a fragmented file is taken
+ * from the fragment files that are present, so a missing fragment
+ * file leaves a gap between its neighbours.  Such gaps are presented
+ * as holes, which read as zeroes.  Given an offset in a hole, return
+ * the offset at which the hole ends.
+ */
+static uint64_t hole_end(struct splitfs_file_info *fh, uint64_t offset)
+{
+	uint64_t num;
+	uint64_t lo;
+	uint64_t hi;
+
+	num = fh->is_recipe_file ? fh->recipe_entries : fh->table->num_frags;
+
+	lo = 0;
+	hi = num;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		uint64_t start;
+
+		if (fh->is_recipe_file)
+			start = fh->recipe[mid].start;
+		else
+			start = fh->table->frags[mid].start;
+
+		if (start <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == num)
+		return fh->size;
+	if (fh->is_recipe_file)
+		return fh->recipe[lo].start;
+	return fh->table->frags[lo].start;
+}
+
+static int open_fragment(struct splitfs_file_info *fh, uint64_t start)
+{
+	uint64_t stat = stat_start();
+	int fd;
+
+	if (fh->is_recipe_file) {
+		const struct recipe_entry *ent;
+		char path[RECIPE_STORE_PATH_MAX];
+
+		ent = find_recipe_entry(fh, start);
+		if (ent == NULL) {
+			stat_end(STAT_FRAG_OPEN, stat);
+			return -1;
+		}
+
+		recipe_store_path(path, ent->hash);
+
+		fd = openat(store_dir_fd, path, O_RDONLY);
+	} else {
+		char name[32];
+
+		snprintf(name, sizeof(name), "%.16jx", (intmax_t)start);
+
+		fd = openat(fh->fd, name, O_RDONLY);
+	}
+
+	if (fd < 0)
+		perror("openat");
+
+	stat_end(STAT_FRAG_OPEN, stat);
+
+	return fd;
+}
+
+/*
+ * Fragment file descriptors are kept open in a small per-file LRU
+ * cache keyed by fragment start offset.  A reader takes the fd out
+ * of the cache for the duration of its pread() and puts it back
+ * afterwards, so that concurrent readers never share an fd that
+ * might be closed from under them by eviction.  Whether a recipe
+ * file's fragment is stored compressed is determined when its fd is
+ * opened, and cached along with it.
+ */
+static int get_fragment_fd(struct splitfs_file_info *fh, uint64_t start,
+			   uint64_t end, int *compressed)
+{
+	struct stat buf;
+	int fd;
+	int i;
+
+	fd = -1;
+	*compressed = 0;
+
+	pthread_mutex_lock(&fh->fd_cache_lock);
+
+	for (i = 0; i < FD_CACHE_SIZE; i++) {
+		struct splitfs_cached_fd *c = fh->fd_cache + i;
+
+		if (c->fd >= 0 && c->start == start) {
+			fd = c->fd;
+			*compressed = c->compressed;
+			c->fd = -1;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&fh->fd_cache_lock);
+
+	if (fd >= 0)
+		return fd;
+
+	fd = open_fragment(fh, start);
+
+	if (fd >= 0 && fh->is_recipe_file) {
+		if (fstat(fd, &buf) < 0) {
+			perror("fstat");
+			close(fd);
+			return -1;
+		}
+		*compressed = (buf.st_size < end - start);
+	}
+
+	return fd;
+}
+
+static void put_fragment_fd(struct splitfs_file_info *fh, uint64_t start,
+			    int fd, int compressed)
+{
+	struct splitfs_cached_fd *victim;
+	int i;
+
+	pthread_mutex_lock(&fh->fd_cache_lock);
+
+	victim = NULL;
+	for (i = 0; i < FD_CACHE_SIZE; i++) {
+		struct splitfs_cached_fd *c = fh->fd_cache + i;
+
+		if (c->fd >= 0 && c->start == start) {
+			pthread_mutex_unlock(&fh->fd_cache_lock);
+			close(fd);
+			return;
+		}
+
+		if (victim == NULL || (victim->fd >= 0 &&
+		    (c->fd < 0 || c->last_use < victim->last_use))) {
+			victim = c;
+		}
+	}
+
+	if (victim->fd >= 0)
+		close(victim->fd);
+
+	victim->start = start;
+	victim->fd = fd;
+	victim->compressed = compressed;
+	victim->last_use = ++fh->fd_cache_clock;
+
+	pthread_mutex_unlock(&fh->fd_cache_lock);
+}
+
+/*
+ * With --mmap, fragments are mapped into our address space on first
+ * use and kept mapped within a global budget, with CLOCK replacement:
+ * a hit only sets the mapping's referenced bit, and the eviction hand
+ * skips (and clears) referenced mappings once before evicting them.
+ * Reads are then answered straight from the mappings, without any
+ * system calls other than the reply itself.  Mappings that are in use
+ * by a reader are never unmapped from under it; eviction just marks
+ * them dead, and the last reader unmaps them.
+ */
+static int compare_mappings(const struct iv_avl_node *_a,
+			    const struct iv_avl_node *_b)
+{
+	const struct splitfs_mapping *a;
+	const struct splitfs_mapping *b;
+
+	a = iv_container_of(_a, struct splitfs_mapping, an);
+	b = iv_container_of(_b, struct splitfs_mapping, an);
+
+	return memcmp(&a->key, &b->key, sizeof(a->key));
+}
+
+static void init_mapping_shards(void)
+{
+	int i;
+
+	for (i = 0; i < MAPPING_SHARDS; i++) {
+		struct splitfs_mapping_shard *shard = mapping_shards + i;
+
+		pthread_mutex_init(&shard->lock, NULL);
+		INIT_IV_AVL_TREE(&shard->mappings, compare_mappings);
+		INIT_IV_LIST_HEAD(&shard->ring);
+		shard->hand = &shard->ring;
+		shard->num = 0;
+	}
+}
+
+static struct splitfs_mapping_shard *
+mapping_shard(const struct splitfs_mapping_key *key)
+{
+	uint64_t h;
+
+	memcpy(&h, key->hash, sizeof(h));
+	h ^= key->dev ^ key->ino ^ (key->start >> 12);
+	h *= 0x9e3779b97f4a7c15ULL;
+
+	return mapping_shards + (h >> 60) % MAPPING_SHARDS;
+}
+
+static struct splitfs_mapping *
+find_mapping(struct splitfs_mapping_shard *shard,
+	     const struct splitfs_mapping_key *key)
+{
+	struct iv_avl_node *an;
+
+	an = shard->mappings.root;
+	while (an != NULL) {
+		struct splitfs_mapping *m;
+		int ret;
+
+		m = iv_container_of(an, struct splitfs_mapping, an);
+
+		ret = memcmp(key, &m->key, sizeof(*key));
+		if (ret == 0)
+			return m;
+
+		if (ret < 0)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+/*
+ * Look up the cache key of the fragment containing offset, and the
+ * offset in the file at which that fragment starts.
+ */
+static int mapping_key(struct splitfs_file_info *fh, uint64_t offset,
+		       struct splitfs_mapping_key *key, uint64_t *start)
+{
+	uint64_t stat = stat_start();
+
+	memset(key, 0, sizeof(*key));
+
+	if (fh->is_recipe_file) {
+		const struct recipe_entry *ent;
+
+		ent = find_recipe_entry(fh, offset);
+		if (ent == NULL)
+			goto fail;
+
+		memcpy(key->hash, ent->hash, HASH_LENGTH);
+		key->end = ent->length;
+		*start = ent->start;
+	} else {
+		const struct fragindex_entry *frag;
+
+		frag = find_fragment(fh, offset);
+		if (frag == NULL)
+			goto fail;
+
+		key->dev = fh->dev;
+		key->ino = fh->ino;
+		key->start = frag->start;
+		key->end = frag->end;
+		*start = frag->start;
+	}
+
+	stat_end(STAT_FRAG_LOOKUP, stat);
+
+	return 0;
+
+fail:
+	stat_end(STAT_FRAG_LOOKUP, stat);
+
+	return -1;
+}
+
+static void __unmap_mapping(struct splitfs_mapping *m)
+{
+	if (m->decompressed)
+		free(m->addr);
+	else
+		munmap(m->addr, m->length);
+	free(m);
+}
+
+static void __drop_mapping(struct splitfs_mapping *m)
+{
+	struct splitfs_mapping_shard *shard = m->shard;
+
+	if (shard->hand == &m->list)
+		shard->hand = m->list.next;
+
+	iv_avl_tree_delete(&shard->mappings, &m->an);
+	iv_list_del(&m->list);
+	shard->num--;
+
+	__atomic_sub_fetch(m->decompressed ? &zcache_bytes : &mappings_bytes,
+			   m->length, __ATOMIC_RELAXED);
+
+	if (m->refcount)
+		m->dead = 1;
+	else
+		__unmap_mapping(m);
+}
+
+/*
+ * Advance a shard's CLOCK hand until enough mappings of the given
+ * kind have been evicted, or until it has gone around twice.
+ * Mappings that are in use by a reader are passed over.
+ */
+static void __evict_shard(struct splitfs_mapping_shard *shard,
+			  int decompressed, uint64_t *bytes, uint64_t max_bytes)
+{
+	unsigned int steps;
+
+	for (steps = 2 * (shard->num + 1); steps; steps--) {
+		struct splitfs_mapping *m;
+
+		if (__atomic_load_n(bytes, __ATOMIC_RELAXED) <= max_bytes)
+			break;
+
+		if (shard->hand == &shard->ring) {
+			shard->hand = shard->ring.next;
+			continue;
+		}
+
+		m = iv_container_of(shard->hand, struct splitfs_mapping, list);
+		shard->hand = m->list.next;
+
+		if (m->decompressed != decompressed || m->refcount)
+			continue;
+
+		if (m->referenced)
+			m->referenced = 0;
+		else
+			__drop_mapping(m);
+	}
+}
+
+static void evict_mappings(int decompressed)
+{
+	uint64_t *bytes;
+	uint64_t max_bytes;
+	int i;
+
+	if (decompressed) {
+		bytes = &zcache_bytes;
+		max_bytes = zcache_max_bytes;
+	} else {
+		bytes = &mappings_bytes;
+		max_bytes = mappings_max_bytes;
+	}
+
+	for (i = 0; i < MAPPING_SHARDS; i++) {
+		struct splitfs_mapping_shard *shard;
+		unsigned int idx;
+
+		if (__atomic_load_n(bytes, __ATOMIC_RELAXED) <= max_bytes)
+			break;
+
+		idx = __atomic_fetch_add(&mapping_evict_shard, 1,
+					 __ATOMIC_RELAXED);
+		shard = mapping_shards + idx % MAPPING_SHARDS;
+
+		pthread_mutex_lock(&shard->lock);
+		__evict_shard(shard, decompressed, bytes, max_bytes);
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+static void free_dctx(void *dctx)
+{
+	ZSTD_freeDCtx(dctx);
+}
+
+/*
+ * Decompress a compressed store fragment, using a decompression
+ * context private to the calling thread.
+ */
+static void *decompress_fragment(int fd, size_t clength, size_t length)
+{
+	ZSTD_DCtx *dctx;
+	uint64_t stat;
+	void *cbuf;
+	void *buf;
+	size_t ret;
+
+	dctx = pthread_getspecific(dctx_key);
+	if (dctx == NULL) {
+		dctx = ZSTD_createDCtx();
+		if (dctx == NULL)
+			return NULL;
+		pthread_setspecific(dctx_key, dctx);
+	}
+
+	cbuf = malloc(clength);
+	buf = malloc(length);
+	if (cbuf == NULL || buf == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (xpread(fd, cbuf, clength, 0) != clength) {
+		free(buf);
+		free(cbuf);
+		return NULL;
+	}
+
+	stat = stat_start();
+	ret = ZSTD_decompressDCtx(dctx, buf, length, cbuf, clength);
+	stat_end(STAT_FRAG_DECOMPRESS, stat);
+
+	free(cbuf);
+
+	if (ZSTD_isError(ret) || ret != length) {
+		fprintf(stderr, "corrupt compressed fragment: %s\n",
+			ZSTD_isError(ret) ? ZSTD_getErrorName(ret) :
+					    "wrong length");
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/*
+ * Map the fragment starting at start, or decompress it if it is a
+ * compressed store fragment.  fd is an fd for the fragment if the
+ * caller already has one, or -1.
+ */
+static struct splitfs_mapping *
+map_fragment(struct splitfs_file_info *fh,
+	     const struct splitfs_mapping_key *key, uint64_t start, int fd)
+{
+	size_t length;
+	struct splitfs_mapping *m;
+	struct stat buf;
+	int decompressed;
+	int our_fd;
+	uint64_t stat;
+	void *addr;
+
+	length = key->end - key->start;
+	if (length == 0)
+		return NULL;
+
+	our_fd = (fd < 0);
+	if (our_fd) {
+		fd = open_fragment(fh, start);
+		if (fd < 0)
+			return NULL;
+	}
+
+	addr = NULL;
+	decompressed = 0;
+
+	/*
+	 * Touching a mapping beyond the end of the file would get us
+	 * killed with SIGBUS, so refuse to map truncated fragments.
+	 */
+	if (fstat(fd, &buf) < 0) {
+		perror("fstat");
+	} else if (buf.st_size >= length) {
+		if (length <= mappings_max_bytes) {
+			stat = stat_start();
+			addr = mmap(NULL, length, PROT_READ, MAP_SHARED,
+				    fd, 0);
+			stat_end(STAT_FRAG_MAP, stat);
+
+			if (addr == MAP_FAILED) {
+				perror("mmap");
+				addr = NULL;
+			}
+		}
+	} else if (fh->is_recipe_file) {
+		addr = decompress_fragment(fd, buf.st_size, length);
+		decompressed = 1;
+	}
+
+	if (our_fd)
+		close(fd);
+
+	if (addr == NULL)
+		return NULL;
+
+	m = malloc(sizeof(*m));
+	if (m == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	m->key = *key;
+	m->shard = mapping_shard(key);
+	m->refcount = 1;
+	m->dead = 0;
+	m->referenced = 0;
+	m->decompressed = decompressed;
+	m->addr = addr;
+	m->length = length;
+
+	return m;
+}
+
+static struct splitfs_mapping *get_mapping(struct splitfs_file_info *fh,
+					   uint64_t offset, int fd,
+					   uint64_t *start)
+{
+	struct splitfs_mapping_shard *shard;
+	struct splitfs_mapping_key key;
+	struct splitfs_mapping *m;
+	struct splitfs_mapping *m2;
+
+	if (mapping_key(fh, offset, &key, start) < 0)
+		return NULL;
+
+	shard = mapping_shard(&key);
+
+	pthread_mutex_lock(&shard->lock);
+
+	m = find_mapping(shard, &key);
+	if (m != NULL) {
+		m->refcount++;
+		m->referenced = 1;
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+
+	if (m != NULL)
+		return m;
+
+	m = map_fragment(fh, &key, *start, fd);
+	if (m == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&shard->lock);
+
+	/*
+	 * Someone else may have mapped the same fragment while we
+	 * weren't holding the lock.  New mappings go in just behind
+	 * the hand, so that they get a full revolution before they
+	 * are considered for eviction.
+	 */
+	m2 = find_mapping(shard, &key);
+	if (m2 != NULL) {
+		m2->refcount++;
+		m2->referenced = 1;
+	} else {
+		iv_avl_tree_insert(&shard->mappings, &m->an);
+		iv_list_add_tail(&m->list, shard->hand);
+		shard->num++;
+
+		__atomic_add_fetch(m->decompressed ? &zcache_bytes :
+				   &mappings_bytes, m->length,
+				   __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+
+	if (m2 != NULL) {
+		__unmap_mapping(m);
+		return m2;
+	}
+
+	evict_mappings(m->decompressed);
+
+	return m;
+}
+
+/*
+ * Mappings that are in use can't be evicted, so the budget can be
+ * exceeded while reads are in flight.  The last reader of a mapping
+ * catches up on any eviction that was held back that way.
+ */
+static void put_mapping(struct splitfs_mapping *m)
+{
+	struct splitfs_mapping_shard *shard = m->shard;
+	int decompressed = m->decompressed;
+	int unused;
+	int unmap;
+
+	pthread_mutex_lock(&shard->lock);
+	unused = (--m->refcount == 0);
+	unmap = (unused && m->dead);
+	pthread_mutex_unlock(&shard->lock);
+
+	if (unmap)
+		__unmap_mapping(m);
+	else if (unused)
+		evict_mappings(decompressed);
+}
+
+/*
+ * Answer a read from mapped fragments, as a vector pointing into
+ * the mappings.  Returns the number of bytes replied with, or 0 if
+ * any of the fragments could not be mapped, in which case the caller
+ * should fall back to reading from the fragment files.
+ */
+static size_t read_mapped(fuse_req_t req, struct splitfs_file_info *fh,
+			  size_t size, uint64_t offset)
+{
+	struct splitfs_mapping *mstack[8];
+	struct iovec iovstack[8];
+	struct splitfs_mapping **maps;
+	struct iovec *iov;
+	size_t alloc;
+	size_t num;
+	size_t done;
+	size_t i;
+
+	maps = mstack;
+	iov = iovstack;
+	alloc = sizeof(mstack) / sizeof(mstack[0]);
+	num = 0;
+	done = 0;
+	while (done < size) {
+		struct splitfs_mapping *m;
+		uint64_t start;
+		size_t chunk;
+
+		m = get_mapping(fh, offset + done, -1, &start);
+		if (m == NULL)
+			break;
+
+		if (num == alloc) {
+			alloc *= 2;
+			if (maps == mstack) {
+				maps = malloc(alloc * sizeof(*maps));
+				iov = malloc(alloc * sizeof(*iov));
+				if (maps != NULL && iov != NULL) {
+					memcpy(maps, mstack, sizeof(mstack));
+					memcpy(iov, iovstack, sizeof(iovstack));
+				}
+			} else {
+				maps = realloc(maps, alloc * sizeof(*maps));
+				iov = realloc(iov, alloc * sizeof(*iov));
+			}
+			if (maps == NULL || iov == NULL) {
+				fprintf(stderr, "out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		chunk = start + m->length - (offset + done);
+		if (chunk > size - done)
+			chunk = size - done;
+
+		maps[num] = m;
+		iov[num].iov_base = m->addr + (offset + done - start);
+		iov[num].iov_len = chunk;
+		num++;
+
+		done += chunk;
+	}
+
+	if (done == size) {
+		uint64_t stat = stat_start();
+
+		fuse_reply_iov(req, iov, num);
+		stat_end(STAT_BACKING_IO, stat);
+	} else {
+		done = 0;
+	}
+
+	for (i = 0; i < num; i++)
+		put_mapping(maps[i]);
+
+	if (maps != mstack) {
+		free(maps);
+		free(iov);
+	}
+
+	return done;
+}
+
+/*
+ * Once a fragmented file is being read sequentially, ask the kernel
+ * to start reading the next few fragments in the background, so that
+ * the reader doesn't stall on I/O each time it crosses a fragment
+ * boundary.  The fds opened for this stay in the fd cache for the
+ * reads that follow.
+ *
+ * The window runs from the last read offset up to the end of the last
+ * fragment prefetched.  A read below the window means that the reader
+ * has seeked backwards, so the window is restarted at its offset.
+ */
+static void prefetch_fragments(struct splitfs_file_info *fh, uint64_t offset)
+{
+	uint64_t cursor;
+	uint64_t prefetched;
+	unsigned int i;
+
+	cursor = __atomic_load_n(&fh->cursor, __ATOMIC_RELAXED);
+	prefetched = __atomic_load_n(&fh->prefetched, __ATOMIC_RELAXED);
+	if (offset < __atomic_load_n(&fh->prefetch_start, __ATOMIC_RELAXED))
+		prefetched = offset;
+	__atomic_store_n(&fh->prefetch_start, offset, __ATOMIC_RELAXED);
+
+	for (i = 0; i < readahead_frags && offset < fh->size; i++) {
+		uint64_t start;
+		uint64_t end;
+		int compressed;
+		int fd;
+
+		if (find_fragment_extent(fh, offset, &start, &end) < 0) {
+			offset = hole_end(fh, offset);
+			continue;
+		}
+
+		offset = end;
+		if (end <= prefetched)
+			continue;
+
+		fd = get_fragment_fd(fh, start, end, &compressed);
+		if (fd < 0)
+			break;
+
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		put_fragment_fd(fh, start, fd, compressed);
+
+		prefetched = end;
+	}
+
+	__atomic_store_n(&fh->prefetched, prefetched, __ATOMIC_RELAXED);
+	__atomic_store_n(&fh->cursor, cursor, __ATOMIC_RELAXED);
+}
+
+/*
+ * Reads are answered with a vector of fd-backed buffers, one per
+ * fragment touched, so that libfuse can splice the data from the
+ * backing files to the kernel without copying it through userspace.
+ * Compressed fragments are served from their decompressed copy in
+ * the mapping cache instead, and holes from a block of zeroes.
+ * Fragment fds and mappings stay checked out until the reply has
+ * been sent.
+ */
+static const char zero_block[65536];
+
+struct splitfs_read_ref {
+	uint64_t		start;
+	int			fd;
+	int			compressed;
+	struct splitfs_mapping	*mapping;
+};
+
+static void __splitfs_read(fuse_req_t req, size_t size, off_t offset,
+			   struct splitfs_file_info *fh)
+{
+	int sequential;
+	struct fuse_bufvec *bufv;
+	struct splitfs_read_ref *refs;
+	size_t num;
+	size_t alloc;
+	size_t i;
+
+	if (!fh->is_fragmented_file && !fh->is_recipe_file) {
+		struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+		uint64_t stat = stat_start();
+
+		buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		buf.buf[0].fd = fh->fd;
+		buf.buf[0].pos = offset;
+
+		fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+		stat_end(STAT_BACKING_IO, stat);
+		return;
+	}
+
+	if (offset < 0) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	if (offset >= fh->size) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+
+	if (offset + size > fh->size)
+		size = fh->size - offset;
+
+	sequential = __atomic_exchange_n(&fh->next_offset, offset + size,
+					 __ATOMIC_RELAXED) == offset;
+
+	if (mappings_max_bytes && read_mapped(req, fh, size, offset)) {
+		if (sequential && readahead_frags)
+			prefetch_fragments(fh, offset + size);
+		return;
+	}
+
+	bufv = NULL;
+	refs = NULL;
+	num = 0;
+	alloc = 0;
+	while (size) {
+		uint64_t start;
+		uint64_t end;
+		size_t chunk_toread;
+		struct splitfs_mapping *m;
+		struct fuse_buf *b;
+		int compressed;
+		int fd;
+
+		fd = -1;
+		compressed = 0;
+		if (find_fragment_extent(fh, offset, &start, &end) < 0) {
+			start = offset;
+			end = hole_end(fh, offset);
+			if (end - offset > sizeof(zero_block))
+				end = offset + sizeof(zero_block);
+		} else {
+			fd = get_fragment_fd(fh, start, end, &compressed);
+			if (fd < 0)
+				break;
+		}
+
+		m = NULL;
+		if (compressed) {
+			m = get_mapping(fh, offset, fd, &start);
+			if (m == NULL) {
+				put_fragment_fd(fh, start, fd, compressed);
+				break;
+			}
+		}
+
+		chunk_toread = end - offset;
+		if (chunk_toread > size)
+			chunk_toread = size;
+
+		if (num == alloc) {
+			alloc = alloc ? 2 * alloc : 4;
+
+			bufv = realloc(bufv, sizeof(*bufv) + (alloc - 1) *
+						     sizeof(bufv->buf[0]));
+			refs = realloc(refs, alloc * sizeof(*refs));
+			if (bufv == NULL || refs == NULL) {
+				fprintf(stderr, "out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		b = bufv->buf + num;
+		b->size = chunk_toread;
+		if (fd < 0) {
+			b->flags = 0;
+			b->mem = (void *)zero_block;
+			b->fd = -1;
+			b->pos = 0;
+		} else if (m != NULL) {
+			b->flags = 0;
+			b->mem = m->addr + (offset - start);
+			b->fd = -1;
+			b->pos = 0;
+		} else {
+			b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK |
+				   FUSE_BUF_FD_RETRY;
+			b->mem = NULL;
+			b->fd = fd;
+			b->pos = offset - start;
+		}
+
+		refs[num].start = start;
+		refs[num].fd = fd;
+		refs[num].compressed = compressed;
+		refs[num].mapping = m;
+		num++;
+
+		size -= chunk_toread;
+		offset += chunk_toread;
+	}
+
+	if (num) {
+		uint64_t stat = stat_start();
+
+		bufv->count = num;
+		bufv->idx = 0;
+		bufv->off = 0;
+		fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+		stat_end(STAT_BACKING_IO, stat);
+	} else {
+		fuse_reply_err(req, EIO);
+	}
+
+	for (i = 0; i < num; i++) {
+		struct splitfs_read_ref *r = refs + i;
+
+		if (r->mapping != NULL)
+			put_mapping(r->mapping);
+		if (r->fd >= 0)
+			put_fragment_fd(fh, r->start, r->fd, r->compressed);
+	}
+
+	free(refs);
+	free(bufv);
+
+	if (sequential && readahead_frags)
+		prefetch_fragments(fh, offset);
+}
+
+static void splitfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	struct splitfs_file_info *fh = (void *)fi->fh;
+	uint64_t start = stat_start();
+
+	if (fh->stats != NULL) {
+		if (offset < 0 || offset >= fh->stats_length)
+			size = 0;
+		else if (size > fh->stats_length - offset)
+			size = fh->stats_length - offset;
+
+		fuse_reply_buf(req, fh->stats + (size ? offset : 0), size);
+		return;
+	}
+
+	if (fh->inode != NULL)
+		pthread_rwlock_rdlock(&fh->inode->rwlock);
+
+	__splitfs_read(req, size, offset, fh);
+
+	if (fh->inode != NULL)
+		pthread_rwlock_unlock(&fh->inode->rwlock);
+
+	stat_end(STAT_READ, start);
+}
+
+/*
+ * In writable mode, a write to a fragmented file rechunks just the
+ * affected region of the file.  Split point decisions depend on the
+ * SPLIT_CRC_BLOCK_SIZE bytes following each position, so a change to
+ * [a, b) can only move split points in (a - SPLIT_CRC_BLOCK_SIZE, b),
+ * and changing the file size can only move split points within
+ * SPLIT_CRC_BLOCK_SIZE bytes of the (old or new) end of the file.
+ * Fragments are also cut when they reach SPLIT_MAX_FRAG_SIZE bytes,
+ * and those cuts can shift arbitrarily far ahead of a change, but we
+ * don't chase them: the fragments after the rewritten range are kept,
+ * and are still within the size limit.
+ *
+ * We take the range of existing fragments covering those positions,
+ * apply the change to it in memory, rescan it for split points with
+ * the same criterion that split uses, and replace the old fragments
+ * with the new ones.  The new fragments are first written to
+ * temporary files and synced, then renamed into place, and only then
+ * are the old fragments that don't coincide with a new one unlinked.
+ * If we crash halfway, this leaves overlapping fragments behind, which
+ * build_frag_table() resolves into a mix of the old and the new
+ * contents of the range.
+ *
+ * All of this happens with the inode lock held for writing, which
+ * excludes all reads from the file, after which every open file of
+ * the inode and the layout cache are switched to the new fragment
+ * table in one go.
+ */
+static uint64_t frag_index(const struct splitfs_frag_table *table,
+			   uint64_t offset)
+{
+	uint64_t lo;
+	uint64_t hi;
+
+	lo = 0;
+	hi = table->num_frags;
+	while (hi - lo > 1) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (table->frags[mid].start <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int read_region(struct splitfs_file_info *fh, uint8_t *buf,
+		       uint64_t from, uint64_t to, uint64_t i)
+{
+	const struct splitfs_frag_table *table = fh->table;
+
+	for (; i < table->num_frags && table->frags[i].start < to; i++) {
+		const struct fragindex_entry *frag = table->frags + i;
+		uint64_t start;
+		uint64_t end;
+		ssize_t ret;
+		int fd;
+
+		start = (frag->start > from) ? frag->start : from;
+		end = (frag->end < to) ? frag->end : to;
+		if (start >= end)
+			continue;
+
+		fd = open_fragment(fh, frag->start);
+		if (fd < 0)
+			return -EIO;
+
+		ret = xpread(fd, buf + (start - from), end - start,
+			     start - frag->start);
+		close(fd);
+
+		if (ret != end - start)
+			return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * New fragments are written sparsely, as split writes them, so that
+ * rewriting part of a zeroed region doesn't allocate the zeroes.
+ */
+#define SPARSE_BLOCK_SIZE	4096
+
+static int is_zero(const uint8_t *buf, size_t length)
+{
+	return buf[0] == 0 && !memcmp(buf, buf + 1, length - 1);
+}
+
+/*
+ * Write a fragment of size bytes, the first length of which are in
+ * buf, and the rest of which are zeroes.
+ */
+static int write_fragment_tmp(int dirfd, const char *name,
+			      const uint8_t *buf, size_t length, uint64_t size)
+{
+	size_t off;
+	int fd;
+	int ret;
+
+	fd = openat(dirfd, name, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+	if (fd < 0) {
+		perror("openat");
+		return -errno;
+	}
+
+	ret = 0;
+	off = 0;
+	while (off < length) {
+		size_t end;
+
+		end = off + SPARSE_BLOCK_SIZE;
+		if (end > length)
+			end = length;
+
+		if (is_zero(buf + off, end - off)) {
+			off = end;
+			continue;
+		}
+
+		while (end < length) {
+			size_t next;
+
+			next = end + SPARSE_BLOCK_SIZE;
+			if (next > length)
+				next = length;
+
+			if (is_zero(buf + end, next - end))
+				break;
+
+			end = next;
+		}
+
+		if (xpwrite(fd, buf + off, end - off, off) < 0) {
+			ret = -errno;
+			break;
+		}
+
+		off = end;
+	}
+
+	if (ret == 0 && ftruncate(fd, size) < 0)
+		ret = -errno;
+
+	if (ret == 0 && fsync(fd) < 0)
+		ret = -errno;
+
+	close(fd);
+
+	if (ret < 0)
+		unlinkat(dirfd, name, 0);
+
+	return ret;
+}
+
+static void tmp_fragment_name(char *name, size_t size, uint64_t start)
+{
+	snprintf(name, size, ".%.16" PRIx64 ".%d", start, (int)getpid());
+}
+
+static void fragment_name(char *name, size_t size, uint64_t start)
+{
+	snprintf(name, size, "%.16" PRIx64, start);
+}
+
+static void update_layout(struct splitfs_file_info *fh)
+{
+	struct stat buf;
+
+	if (fstat(fh->fd, &buf) < 0)
+		return;
+
+	pthread_mutex_lock(&layouts_lock);
+	fh->table->refcount++;
+	__install_layout(&buf, fh->table);
+	pthread_mutex_unlock(&layouts_lock);
+}
+
+/*
+ * Point every open file of the inode at the given fragment table, and
+ * drop any cached fds and mappings of fragments in [from, to), whose
+ * contents may have changed.
+ */
+static void switch_frag_table(struct splitfs_inode *inode,
+			      struct splitfs_frag_table *table,
+			      uint64_t from, uint64_t to)
+{
+	struct iv_list_head *lh;
+	struct iv_list_head *lh2;
+	int i;
+
+	iv_list_for_each (lh, &inode->open_files) {
+		struct splitfs_file_info *fh;
+
+		fh = iv_container_of(lh, struct splitfs_file_info, list);
+
+		if (fh->table != table) {
+			pthread_mutex_lock(&layouts_lock);
+			table->refcount++;
+			__put_frag_table(fh->table);
+			pthread_mutex_unlock(&layouts_lock);
+
+			fh->table = table;
+		}
+
+		fh->size = table->size;
+		fh->cursor = 0;
+		fh->prefetch_start = 0;
+		fh->prefetched = 0;
+
+		for (i = 0; i < FD_CACHE_SIZE; i++) {
+			struct splitfs_cached_fd *c = fh->fd_cache + i;
+
+			if (c->fd >= 0 && c->start >= from && c->start < to) {
+				close(c->fd);
+				c->fd = -1;
+			}
+		}
+	}
+
+	if (!mappings_max_bytes)
+		return;
+
+	for (i = 0; i < MAPPING_SHARDS; i++) {
+		struct splitfs_mapping_shard *shard = mapping_shards + i;
+
+		pthread_mutex_lock(&shard->lock);
+
+		iv_list_for_each_safe (lh, lh2, &shard->ring) {
+			struct splitfs_mapping *m;
+
+			m = iv_container_of(lh, struct splitfs_mapping, list);
+			if (m->key.dev == inode->dev &&
+			    m->key.ino == inode->ino &&
+			    m->key.start >= from && m->key.start < to) {
+				__drop_mapping(m);
+			}
+		}
+
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+static int replaces_fragment(const struct splitfs_frag_table *table,
+			     uint64_t start)
+{
+	uint64_t i;
+
+	i = frag_index(table, start);
+
+	return i < table->num_frags && table->frags[i].start == start;
+}
+
+static void unlink_tmp_fragments(int dirfd, const uint64_t *points,
+				 uint64_t num_points)
+{
+	char tmp[64];
+	uint64_t i;
+
+	for (i = 0; i < num_points; i++) {
+		tmp_fragment_name(tmp, sizeof(tmp), points[i]);
+		unlinkat(dirfd, tmp, 0);
+	}
+}
+
+/*
+ * After a failure that left the fragment directory in a state that
+ * neither the old nor the new fragment table describes, switch to a
+ * table built from the directory, as a crash at that point would.
+ */
+static int reload_frag_table(struct splitfs_file_info *fh)
+{
+	struct splitfs_frag_table *table;
+	struct stat buf;
+	int ret;
+
+	if (fstat(fh->fd, &buf) < 0)
+		return -errno;
+
+	ret = build_frag_table(fh->fd, &buf, &table);
+	if (ret < 0)
+		return ret;
+
+	table->refcount = 0;
+	switch_frag_table(fh->inode, table, 0, UINT64_MAX);
+	update_layout(fh);
+
+	return 0;
+}
+
+static void add_split_point(uint64_t **points, uint64_t *num_points,
+			    uint64_t *alloc, uint64_t p)
+{
+	if (*num_points == *alloc) {
+		*alloc *= 2;
+		*points = realloc(*points, *alloc * sizeof(**points));
+		if (*points == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	(*points)[(*num_points)++] = p;
+}
+
+static int rewrite_fragments(struct splitfs_file_info *fh, const void *data,
+			     size_t size, uint64_t offset, uint64_t new_size)
+{
+	struct splitfs_frag_table *table = fh->table;
+	struct splitfs_frag_table *newtable;
+	uint64_t old_size;
+	uint64_t num;
+	uint64_t lo;
+	uint64_t start;
+	uint64_t end;
+	uint64_t i0;
+	uint64_t i1;
+	uint64_t zero_from;
+	size_t lookahead;
+	uint64_t buf_end;
+	uint8_t *buf;
+	uint64_t *points;
+	uint64_t num_points;
+	uint64_t alloc;
+	uint64_t p;
+	uint64_t i;
+	uint64_t j;
+	char name[64];
+	char tmp[64];
+	int ret;
+
+	old_size = table->size;
+	num = table->num_frags;
+
+	lo = offset;
+	if (lo > old_size)
+		lo = old_size;
+	if (lo > new_size)
+		lo = new_size;
+	lo = (lo > SPLIT_CRC_BLOCK_SIZE) ? lo - SPLIT_CRC_BLOCK_SIZE : 0;
+
+	i0 = frag_index(table, lo);
+	start = 0;
+	if (num && table->frags[i0].start <= lo)
+		start = table->frags[i0].start;
+
+	if (new_size != old_size || offset + size >= old_size) {
+		end = new_size;
+		i1 = num;
+	} else {
+		i1 = frag_index(table, offset + size - 1);
+		end = table->frags[i1].end;
+		i1++;
+		if (end < offset + size) {
+			end = new_size;
+			i1 = num;
+		}
+	}
+
+	/*
+	 * If the file is being extended, everything from zero_from
+	 * to the new end of the file is zeroes.  Those are not read
+	 * into memory: a window of zeroes is never a split point, so
+	 * only the size limit cuts them up.
+	 */
+	zero_from = old_size;
+	if (size && offset + size > zero_from)
+		zero_from = offset + size;
+	if (zero_from > end)
+		zero_from = end;
+
+	lookahead = 0;
+	if (end < new_size) {
+		lookahead = SPLIT_CRC_BLOCK_SIZE - 1;
+		if (lookahead > new_size - end)
+			lookahead = new_size - end;
+	}
+
+	buf_end = end + lookahead;
+	if (buf_end > zero_from + SPLIT_CRC_BLOCK_SIZE - 1)
+		buf_end = zero_from + SPLIT_CRC_BLOCK_SIZE - 1;
+
+	if (buf_end - start > REWRITE_MAX_BYTES)
+		return -EFBIG;
+
+	buf = calloc(1, buf_end - start);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	p = buf_end;
+	if (p > old_size)
+		p = old_size;
+	ret = read_region(fh, buf, start, p, i0);
+	if (ret < 0) {
+		free(buf);
+		return ret;
+	}
+
+	if (size)
+		memcpy(buf + (offset - start), data, size);
+
+	/*
+	 * Find the new split points in (start, end), which can't
+	 * be closer than SPLIT_CRC_BLOCK_SIZE bytes to the end of
+	 * the file, and cut fragments that would grow longer than
+	 * SPLIT_MAX_FRAG_SIZE, as split does.
+	 */
+	alloc = 16;
+	points = malloc(alloc * sizeof(*points));
+	if (points == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	num_points = 0;
+	points[num_points++] = start;
+	for (p = start + 1; p < zero_from; p++) {
+		if (p - points[num_points - 1] < SPLIT_MAX_FRAG_SIZE &&
+		    (p + SPLIT_CRC_BLOCK_SIZE > new_size ||
+		     !is_split_point(buf + (p - start), SPLIT_CRC_BLOCK_SIZE,
+				     SPLIT_CRC_THRESH))) {
+			continue;
+		}
+
+		add_split_point(&points, &num_points, &alloc, p);
+	}
+
+	while (end - points[num_points - 1] > SPLIT_MAX_FRAG_SIZE) {
+		add_split_point(&points, &num_points, &alloc,
+				points[num_points - 1] + SPLIT_MAX_FRAG_SIZE);
+	}
+
+	/*
+	 * Write out the new fragments.  If the file is now empty,
+	 * this leaves a single empty fragment at offset zero, which
+	 * is what marks the directory as a fragmented file.
+	 */
+	ret = 0;
+	for (i = 0; i < num_points; i++) {
+		uint64_t pend;
+		uint64_t dend;
+		uint8_t *src;
+
+		pend = (i + 1 < num_points) ? points[i + 1] : end;
+
+		dend = (pend < buf_end) ? pend : buf_end;
+		if (dend < points[i])
+			dend = points[i];
+		src = (dend > points[i]) ? buf + (points[i] - start) : NULL;
+
+		tmp_fragment_name(tmp, sizeof(tmp), points[i]);
+
+		ret = write_fragment_tmp(fh->fd, tmp, src, dend - points[i],
+					 pend - points[i]);
+		if (ret < 0)
+			break;
+	}
+
+	free(buf);
+
+	if (ret < 0) {
+		unlink_tmp_fragments(fh->fd, points, i);
+		free(points);
+		return ret;
+	}
+
+	if (unlinkat(fh->fd, FRAGINDEX_NAME, 0) == 0)
+		fh->inode->rewrite_index = 1;
+
+	/*
+	 * Rename the new fragments into place.  Those at offsets where
+	 * there was no fragment before go first, as they can still be
+	 * taken out again if renaming one of them fails, which leaves
+	 * the file as it was.  Once we start replacing old fragments,
+	 * there is no going back, and a failure leaves the file in the
+	 * same state as a crash would.
+	 *
+	 * Both passes go backwards through the file, so that the new
+	 * fragments that are in place at any time always extend up to
+	 * the start of another fragment that's there.
+	 */
+	i = num_points;
+	while (i--) {
+		if (replaces_fragment(table, points[i]))
+			continue;
+
+		tmp_fragment_name(tmp, sizeof(tmp), points[i]);
+		fragment_name(name, sizeof(name), points[i]);
+
+		if (renameat(fh->fd, tmp, fh->fd, name) < 0) {
+			ret = -errno;
+			perror("renameat");
+			break;
+		}
+	}
+
+	if (ret < 0) {
+		for (i++; i < num_points; i++) {
+			if (replaces_fragment(table, points[i]))
+				continue;
+
+			fragment_name(name, sizeof(name), points[i]);
+			unlinkat(fh->fd, name, 0);
+		}
+		unlink_tmp_fragments(fh->fd, points, num_points);
+		free(points);
+		return ret;
+	}
+
+	i = num_points;
+	while (i--) {
+		if (!replaces_fragment(table, points[i]))
+			continue;
+
+		tmp_fragment_name(tmp, sizeof(tmp), points[i]);
+		fragment_name(name, sizeof(name), points[i]);
+
+		if (renameat(fh->fd, tmp, fh->fd, name) < 0) {
+			ret = -errno;
+			perror("renameat");
+			break;
+		}
+	}
+
+	if (ret < 0) {
+		unlink_tmp_fragments(fh->fd, points, num_points);
+		free(points);
+		if (reload_frag_table(fh) < 0)
+			fprintf(stderr, "can't reload fragment table\n");
+		return ret;
+	}
+
+	/*
+	 * Make the renames durable before unlinking the old fragments
+	 * that weren't replaced.  These are unlinked in file order, and
+	 * we stop at the first failure, so that each old fragment left
+	 * behind still extends up to the start of the next fragment
+	 * that's left, as build_frag_table() expects.
+	 */
+	if (fsync(fh->fd) < 0)
+		perror("fsync");
+
+	j = 0;
+	for (i = i0; i < i1; i++) {
+		uint64_t s = table->frags[i].start;
+
+		while (j < num_points && points[j] < s)
+			j++;
+
+		if (j < num_points && points[j] == s)
+			continue;
+
+		fragment_name(name, sizeof(name), s);
+		if (unlinkat(fh->fd, name, 0) < 0 && errno != ENOENT) {
+			ret = -errno;
+			perror("unlinkat");
+			break;
+		}
+	}
+
+	if (ret < 0) {
+		free(points);
+		if (reload_frag_table(fh) < 0)
+			fprintf(stderr, "can't reload fragment table\n");
+		return ret;
+	}
+
+	/*
+	 * And update the fragment table to match, in place if the
+	 * number of fragments didn't change.
+	 */
+	if (num_points == i1 - i0) {
+		newtable = table;
+	} else {
+		newtable = malloc(sizeof(*newtable) + (num - (i1 - i0) +
+				  num_points) * sizeof(newtable->frags[0]));
+		if (newtable == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		newtable->refcount = 0;
+		newtable->num_frags = num - (i1 - i0) + num_points;
+		memcpy(newtable->frags, table->frags,
+		       i0 * sizeof(table->frags[0]));
+		memcpy(newtable->frags + i0 + num_points, table->frags + i1,
+		       (num - i1) * sizeof(table->frags[0]));
+	}
+
+	for (i = 0; i < num_points; i++) {
+		struct fragindex_entry *frag = newtable->frags + i0 + i;
+
+		frag->start = points[i];
+		frag->end = (i + 1 < num_points) ? points[i + 1] : end;
+	}
+	newtable->size = new_size;
+
+	free(points);
+
+	switch_frag_table(fh->inode, newtable,
+			  start, (i1 == num) ? UINT64_MAX : end);
+	update_layout(fh);
+
+	return ret;
+}
+
+static int write_fragindex(struct splitfs_file_info *fh)
+{
+	struct splitfs_frag_table *table = fh->table;
+	struct fragindex_header hdr;
+	size_t length;
+	int fd;
+	int ret;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, FRAGINDEX_MAGIC, sizeof(hdr.magic));
+	hdr.num_entries = table->num_frags;
+	hdr.file_size = table->size;
+
+	fd = openat(fh->fd, FRAGINDEX_NAME, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+	if (fd < 0) {
+		perror("openat");
+		return -errno;
+	}
+
+	length = table->num_frags * sizeof(table->frags[0]);
+
+	ret = 0;
+	if (xpwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    xpwrite(fd, table->frags, length, sizeof(hdr)) != length) {
+		ret = -EIO;
+		unlinkat(fh->fd, FRAGINDEX_NAME, 0);
+	}
+
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Writes drop the fragment index, which would otherwise have to be
+ * rewritten in full for every write.  When the last writer of a file
+ * that had an index closes it, we write out a new one.
+ */
+static void unlist_file_info(struct splitfs_file_info *fh)
+{
+	struct splitfs_inode *inode = fh->inode;
+	struct iv_list_head *lh;
+
+	pthread_rwlock_wrlock(&inode->rwlock);
+
+	iv_list_del(&fh->list);
+
+	if (fh->writable && inode->rewrite_index) {
+		iv_list_for_each (lh, &inode->open_files) {
+			struct splitfs_file_info *fh2;
+
+			fh2 = iv_container_of(lh, struct splitfs_file_info,
+					      list);
+			if (fh2->writable)
+				break;
+		}
+
+		if (lh == &inode->open_files && write_fragindex(fh) == 0) {
+			inode->rewrite_index = 0;
+			update_layout(fh);
+		}
+	}
+
+	pthread_rwlock_unlock(&inode->rwlock);
+}
+
+static void splitfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+			  size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct splitfs_file_info *fh = (void *)fi->fh;
+	uint64_t start = stat_start();
+	uint64_t new_size;
+	int ret;
+
+	if (!fh->writable) {
+		fuse_reply_err(req, EBADF);
+		stat_end(STAT_WRITE, start);
+		return;
+	}
+
+	if (offset < 0) {
+		fuse_reply_err(req, EINVAL);
+		stat_end(STAT_WRITE, start);
+		return;
+	}
+
+	if (!fh->is_fragmented_file) {
+		ssize_t written;
+
+		written = xpwrite(fh->fd, buf, size, offset);
+		if (written < 0)
+			fuse_reply_err(req, errno);
+		else
+			fuse_reply_write(req, written);
+
+		stat_end(STAT_WRITE, start);
+		return;
+	}
+
+	/*
+	 * A write beyond the end of the file first extends the file
+	 * up to the write, so that the gap is written out as zeroes
+	 * rather than rechunked in memory along with the write.
+	 */
+	ret = 0;
+	if (size) {
+		pthread_rwlock_wrlock(&fh->inode->rwlock);
+
+		if (offset > fh->table->size)
+			ret = rewrite_fragments(fh, NULL, 0, offset, offset);
+
+		if (ret == 0) {
+			new_size = fh->table->size;
+			if (new_size < offset + size)
+				new_size = offset + size;
+
+			ret = rewrite_fragments(fh, buf, size, offset,
+						new_size);
+		}
+
+		pthread_rwlock_unlock(&fh->inode->rwlock);
+	}
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, size);
+
+	stat_end(STAT_WRITE, start);
+}
+
+static int truncate_file(struct splitfs_inode *inode,
+			 struct splitfs_file_info *fh, uint64_t size)
+{
+	struct fuse_file_info fi;
+	int ret;
+
+	if (fh == NULL || !fh->writable) {
+		memset(&fi, 0, sizeof(fi));
+		fi.flags = O_WRONLY;
+
+		ret = open_file_info(inode, &fi);
+		if (ret < 0)
+			return ret;
+
+		ret = truncate_file(inode, (void *)fi.fh, size);
+		free_splitfs_file_info((void *)fi.fh);
+
+		return ret;
+	}
+
+	if (!fh->is_fragmented_file) {
+		if (ftruncate(fh->fd, size) < 0)
+			return -errno;
+		return 0;
+	}
+
+	pthread_rwlock_wrlock(&inode->rwlock);
+
+	ret = 0;
+	if (size != fh->table->size)
+		ret = rewrite_fragments(fh, NULL, 0, size, size);
+
+	pthread_rwlock_unlock(&inode->rwlock);
+
+	return ret;
+}
+
+static void splitfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			  struct fuse_file_info *fi)
+{
+	struct splitfs_file_info *fh = (void *)fi->fh;
+	int ret;
+
+	/*
+	 * A fragmented file's data is spread over many files, so
+	 * just sync the whole file system that it lives on.
+	 */
+	if (fh->is_fragmented_file)
+		ret = syncfs(fh->fd);
+	else if (datasync)
+		ret = fdatasync(fh->fd);
+	else
+		ret = fsync(fh->fd);
+
+	fuse_reply_err(req, (ret < 0) ? errno : 0);
+}
+
+/*
+ * The data and holes of a fragmented or recipe file are those of its
+ * fragment files, plus the gaps between fragments.  Compressed store
+ * fragments count as all data.
+ */
+static off_t seek_fragments(struct splitfs_file_info *fh, uint64_t offset,
+			    int whence)
+{
+	while (offset < fh->size) {
+		uint64_t start;
+		uint64_t end;
+		int compressed;
+		off_t pos;
+		int fd;
+
+		if (find_fragment_extent(fh, offset, &start, &end) < 0) {
+			if (whence == SEEK_HOLE)
+				return offset;
+			offset = hole_end(fh, offset);
+			continue;
+		}
+
+		fd = get_fragment_fd(fh, start, end, &compressed);
+		if (fd < 0)
+			return -EIO;
+
+		if (compressed) {
+			pos = offset - start;
+			if (whence == SEEK_HOLE)
+				pos = end - start;
+		} else {
+			pos = lseek(fd, offset - start, whence);
+			if (pos < 0 && errno == ENXIO)
+				pos = end - start;
+			else if (pos < 0)
+				pos = -errno;
+		}
+
+		put_fragment_fd(fh, start, fd, compressed);
+
+		if (pos < 0)
+			return pos;
+
+		if (start + pos < end)
+			return start + pos;
+
+		offset = end;
+	}
+
+	return (whence == SEEK_HOLE) ? fh->size : -ENXIO;
+}
+
+static void splitfs_lseek(fuse_req_t req, fuse_ino_t ino, off_t offset,
+			  int whence, struct fuse_file_info *fi)
+{
+	struct splitfs_file_info *fh = (void *)fi->fh;
+	off_t ret;
+
+	if ((whence != SEEK_DATA && whence != SEEK_HOLE) || offset < 0) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	if (fh->stats != NULL) {
+		if (offset >= fh->stats_length)
+			ret = -ENXIO;
+		else if (whence == SEEK_DATA)
+			ret = offset;
+		else
+			ret = fh->stats_length;
+	} else if (!fh->is_fragmented_file && !fh->is_recipe_file) {
+		ret = lseek(fh->fd, offset, whence);
+		if (ret < 0)
+			ret = -errno;
+	} else {
+		if (fh->inode != NULL)
+			pthread_rwlock_rdlock(&fh->inode->rwlock);
+
+		if (offset >= fh->size)
+			ret = -ENXIO;
+		else
+			ret = seek_fragments(fh, offset, whence);
+
+		if (fh->inode != NULL)
+			pthread_rwlock_unlock(&fh->inode->rwlock);
+	}
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_lseek(req, ret);
+}
+
+/*
+ * Holes in the source are reproduced in the destination by punching
+ * a hole, so that copying a sparse image keeps it sparse.
+ */
+static int zero_fd_range(int fd, off_t offset, size_t len)
+{
+	struct stat buf;
+
+	if (fstat(fd, &buf) < 0)
+		return -errno;
+
+	if (offset < buf.st_size &&
+	    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      offset, len) < 0) {
+		size_t done;
+
+		for (done = 0; done < len; ) {
+			size_t chunk;
+
+			chunk = len - done;
+			if (chunk > sizeof(zero_block))
+				chunk = sizeof(zero_block);
+
+			if (xpwrite(fd, zero_block, chunk, offset + done) < 0)
+				return -errno;
+
+			done += chunk;
+		}
+	}
+
+	if (offset + len > buf.st_size && ftruncate(fd, offset + len) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Copy a range between two fds with copy_file_range(2), which lets
+ * the backing file system share extents or copy server-side where it
+ * can, falling back to copying through a buffer where the kernel
+ * can't copy between the two files.
+ */
+static ssize_t __copy_fd_range(int infd, off_t inoff, int outfd,
+			       off_t outoff, size_t len)
+{
+	size_t done;
+	char *buf;
+
+	done = 0;
+	while (done < len) {
+		ssize_t ret;
+
+		do {
+			ret = copy_file_range(infd, &inoff, outfd, &outoff,
+					      len - done, 0);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret == 0)
+			return done;
+
+		if (ret < 0) {
+			if (errno != EXDEV && errno != EINVAL &&
+			    errno != EOPNOTSUPP && errno != ENOSYS) {
+				return done ? done : -errno;
+			}
+			break;
+		}
+
+		done += ret;
+	}
+
+	if (done == len)
+		return done;
+
+	buf = malloc(sizeof(zero_block));
+	if (buf == NULL)
+		return done ? done : -ENOMEM;
+
+	while (done < len) {
+		size_t chunk;
+		ssize_t ret;
+
+		chunk = len - done;
+		if (chunk > sizeof(zero_block))
+			chunk = sizeof(zero_block);
+
+		ret = xpread(infd, buf, chunk, inoff);
+		if (ret > 0 && xpwrite(outfd, buf, ret, outoff) < 0)
+			ret = -1;
+
+		if (ret <= 0) {
+			if (ret < 0 && !done)
+				done = -errno;
+			break;
+		}
+
+		inoff += ret;
+		outoff += ret;
+		done += ret;
+	}
+
+	free(buf);
+
+	return done;
+}
+
+static ssize_t copy_fd_range(int infd, off_t inoff, int outfd, off_t outoff,
+			     size_t len)
+{
+	struct stat buf;
+	off_t end;
+	off_t pos;
+
+	if (fstat(infd, &buf) < 0)
+		return -errno;
+
+	if (inoff >= buf.st_size)
+		return 0;
+
+	end = inoff + len;
+	if (end > buf.st_size)
+		end = buf.st_size;
+
+	pos = inoff;
+	while (pos < end) {
+		off_t data;
+		off_t hole;
+		ssize_t ret;
+
+		data = lseek(infd, pos, SEEK_DATA);
+		if (data < 0)
+			data = (errno == ENXIO) ? end : pos;
+		if (data > end)
+			data = end;
+
+		if (data > pos) {
+			ret = zero_fd_range(outfd, outoff + (pos - inoff),
+					    data - pos);
+			if (ret < 0)
+				return (pos > inoff) ? pos - inoff : ret;
+			pos = data;
+			if (pos == end)
+				break;
+		}
+
+		hole = lseek(infd, pos, SEEK_HOLE);
+		if (hole < 0 || hole > end)
+			hole = end;
+
+		ret = __copy_fd_range(infd, pos, outfd, outoff + (pos - inoff),
+				      hole - pos);
+		if (ret <= 0)
+			return (pos > inoff) ? pos - inoff : ret;
+
+		pos += ret;
+		if (pos < hole)
+			break;
+	}
+
+	return pos - inoff;
+}
+
+static ssize_t copy_fragments(struct splitfs_file_info *fh, uint64_t offset,
+			      int outfd, off_t outoff, size_t len)
+{
+	size_t done;
+
+	if (offset >= fh->size)
+		return 0;
+
+	if (len > fh->size - offset)
+		len = fh->size - offset;
+
+	done = 0;
+	while (done < len) {
+		struct splitfs_mapping *m;
+		uint64_t start;
+		uint64_t end;
+		size_t chunk;
+		int compressed;
+		ssize_t ret;
+		int fd;
+
+		if (find_fragment_extent(fh, offset, &start, &end) < 0) {
+			end = hole_end(fh, offset);
+			chunk = end - offset;
+			if (chunk > len - done)
+				chunk = len - done;
+
+			ret = zero_fd_range(outfd, outoff, chunk);
+			if (ret == 0)
+				ret = chunk;
+		} else {
+			chunk = end - offset;
+			if (chunk > len - done)
+				chunk = len - done;
+
+			fd = get_fragment_fd(fh, start, end, &compressed);
+			if (fd < 0) {
+				ret = -EIO;
+			} else if (compressed) {
+				m = get_mapping(fh, offset, fd, &start);
+				if (m != NULL) {
+					ret = xpwrite(outfd, m->addr +
+						      (offset - start),
+						      chunk, outoff);
+					if (ret < 0)
+						ret = -errno;
+					put_mapping(m);
+				} else {
+					ret = -EIO;
+				}
+			} else {
+				ret = copy_fd_range(fd, offset - start, outfd,
+						    outoff, chunk);
+			}
+
+			if (fd >= 0)
+				put_fragment_fd(fh, start, fd, compressed);
+		}
+
+		if (ret <= 0)
+			return done ? done : ret;
+
+		offset += ret;
+		outoff += ret;
+		done += ret;
+
+		if (ret < chunk)
+			break;
+	}
+
+	return done;
+}
+
+/*
+ * Copies out of any file into a plain file opened for writing are
+ * done here, between the backing files, instead of as reads and
+ * writes through the kernel.  Other destinations get EOPNOTSUPP,
+ * which makes the kernel fall back to doing just that.
+ */
+static void splitfs_copy_file_range(fuse_req_t req, fuse_ino_t ino_in,
+				    off_t off_in, struct fuse_file_info *fi_in,
+				    fuse_ino_t ino_out, off_t off_out,
+				    struct fuse_file_info *fi_out, size_t len,
+				    int flags)
+{
+	struct splitfs_file_info *in = (void *)fi_in->fh;
+	struct splitfs_file_info *out = (void *)fi_out->fh;
+	uint64_t start = stat_start();
+	ssize_t ret;
+
+	if (flags || off_in < 0 || off_out < 0) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	if (in->stats != NULL || out->stats != NULL || !out->writable ||
+	    out->is_fragmented_file) {
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+
+	if (!in->is_fragmented_file && !in->is_recipe_file) {
+		ret = copy_fd_range(in->fd, off_in, out->fd, off_out, len);
+	} else {
+		if (in->inode != NULL)
+			pthread_rwlock_rdlock(&in->inode->rwlock);
+
+		ret = copy_fragments(in, off_in, out->fd, off_out, len);
+
+		if (in->inode != NULL)
+			pthread_rwlock_unlock(&in->inode->rwlock);
+	}
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+
+	stat_end(STAT_COPY_FILE_RANGE, start);
+}
+
+static void splitfs_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs buf;
+
+	if (fstatvfs(backing_dir_fd, &buf) < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	fuse_reply_statfs(req, &buf);
+}
+
+static void splitfs_release(fuse_req_t req, fuse_ino_t ino,
+			    struct fuse_file_info *fi)
+{
+	struct splitfs_file_info *fh = (void *)fi->fh;
+
+#ifdef FUSE_CAP_PASSTHROUGH
+	if (fh->backing_id)
+		fuse_passthrough_close(req, fh->backing_id);
+#endif
+
+	free_splitfs_file_info(fh);
+
+	fuse_reply_err(req, 0);
+}
 
-	if (!fh->is_fragmented_file) {
-		ssize_t ret;
+static void splitfs_opendir(fuse_req_t req, fuse_ino_t ino,
+			    struct fuse_file_info *fi)
+{
+	struct splitfs_inode *inode = get_inode(ino);
+	struct splitfs_dir *d;
+	int fd;
 
-		ret = pread(fh->fd, buf, size, offset);
-		if (ret < 0)
-			return -errno;
+	fd = openat(inode->fd, ".", O_DIRECTORY | O_RDONLY);
+	if (fd < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
 
-		return ret;
+	d = malloc(sizeof(*d));
+	if (d == NULL) {
+		fprintf(stderr, "out of memory\n");
+		close(fd);
+		fuse_reply_err(req, ENOMEM);
+		return;
 	}
 
-	if (offset < 0)
-		return -EINVAL;
-	if (offset >= fh->size)
-		return 0;
+	d->dirp = fdopendir(fd);
+	if (d->dirp == NULL) {
+		fuse_reply_err(req, errno);
+		close(fd);
+		free(d);
+		return;
+	}
 
-	if (size > SSIZE_MAX)
-		size = SSIZE_MAX;
-	if (offset + size > fh->size)
-		size = fh->size - offset;
+	d->entry = NULL;
+	d->offset = 0;
 
-	processed = 0;
-	while (size) {
-		struct splitfs_file_fragment *frag;
-		uint64_t chunk_offset;
-		ssize_t chunk_toread;
-		char name[32];
-		int fd;
-		ssize_t ret;
+	fi->fh = (int64_t)d;
+	if (immutable) {
+		fi->keep_cache = 1;
+		fi->cache_readdir = 1;
+	}
 
-		frag = find_fragment(fh, offset);
-		if (frag == NULL)
-			goto eio;
+	fuse_reply_open(req, fi);
+}
 
-		chunk_offset = offset - frag->start;
+static void __splitfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			      off_t offset, struct fuse_file_info *fi)
+{
+	struct splitfs_dir *d = (void *)fi->fh;
+	char *buf;
+	char *p;
+	size_t rem;
+	int err;
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
 
-		chunk_toread = frag->end - offset;
-		if (chunk_toread > size)
-			chunk_toread = size;
+	if (offset != d->offset) {
+		seekdir(d->dirp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
 
-		snprintf(name, sizeof(name), "%.16jx", (intmax_t)frag->start);
+	err = 0;
+	p = buf;
+	rem = size;
+	while (1) {
+		struct stat st;
+		size_t entsize;
 
-		fd = openat(fh->fd, name, O_RDONLY);
-		if (fd < 0) {
-			perror("openat");
-			goto eio;
-		}
+		if (d->entry == NULL) {
+			errno = 0;
 
-		ret = xpread(fd, buf, chunk_toread, chunk_offset);
-		if (ret <= 0) {
-			close(fd);
-			goto eio;
+			d->entry = readdir(d->dirp);
+			if (d->entry == NULL) {
+				err = errno;
+				break;
+			}
 		}
 
-		close(fd);
+		/*
+		 * Directories might be fragmented files, so leave their
+		 * type for getattr to report.
+		 */
+		memset(&st, 0, sizeof(st));
+		st.st_ino = d->entry->d_ino;
+		if (d->entry->d_type != DT_DIR)
+			st.st_mode = DTTOIF(d->entry->d_type);
+
+		entsize = fuse_add_direntry(req, p, rem, d->entry->d_name,
+					    &st, d->entry->d_off);
+		if (entsize > rem)
+			break;
 
-		buf += ret;
-		size -= ret;
-		offset += ret;
+		p += entsize;
+		rem -= entsize;
 
-		processed += ret;
+		d->offset = d->entry->d_off;
+		d->entry = NULL;
 	}
 
-	return processed;
+	if (err && rem == size)
+		fuse_reply_err(req, err);
+	else
+		fuse_reply_buf(req, buf, size - rem);
 
-eio:
-	return processed ? processed : -EIO;
+	free(buf);
 }
 
-static int splitfs_statfs(const char *path, struct statvfs *buf)
+static void splitfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			    off_t offset, struct fuse_file_info *fi)
 {
-	int ret;
+	uint64_t start = stat_start();
+
+	__splitfs_readdir(req, ino, size, offset, fi);
 
-	if (strcmp(path, "/")) {
-		fprintf(stderr, "statfs called with [%s]\n", path);
-		return -ENOENT;
+	stat_end(STAT_READDIR, start);
+}
+
+/*
+ * readdirplus looks up every entry it returns, which for fragment
+ * directories can mean scanning the directory.  We read a batch of
+ * entries that will probably fit in the reply first, and if there are
+ * enough of them, queue the batch for a persistent pool of lookup
+ * threads, which help the request thread work through it.
+ */
+struct readdirplus_entry {
+	char			*name;
+	off_t			offset;
+	ino_t			d_ino;
+	unsigned char		d_type;
+	struct fuse_entry_param	e;
+};
+
+struct readdirplus_job {
+	struct iv_list_head		list;
+	struct splitfs_inode		*dir;
+	struct readdirplus_entry	*ents;
+	int				num;
+	int				next;
+	int				helpers;
+	int				max_helpers;
+	int				users;
+};
+
+#define READDIRPLUS_PARALLEL_MIN	8
+#define READDIRPLUS_MAX_THREADS		8
+
+/*
+ * Jobs stay on the queue until max_helpers pool threads have picked
+ * them up, or until the request thread runs out of entries to look up.
+ * users counts the pool threads still working on a job, which the
+ * request thread waits to drop to zero before returning.
+ */
+static pthread_mutex_t readdirplus_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readdirplus_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t readdirplus_idle = PTHREAD_COND_INITIALIZER;
+static struct iv_list_head readdirplus_jobs =
+	IV_LIST_HEAD_INIT(readdirplus_jobs);
+static int readdirplus_threads;
+
+static void readdirplus_lookup(struct readdirplus_job *job,
+			       struct readdirplus_entry *ent)
+{
+	if (strcmp(ent->name, ".") && strcmp(ent->name, "..") &&
+	    do_lookup(job->dir, ent->name, &ent->e) == 0) {
+		return;
 	}
 
-	ret = fstatvfs(backing_dir_fd, buf);
-	if (ret < 0)
-		return -errno;
+	/*
+	 * Return entries that we can't look up without attributes,
+	 * like readdir would.
+	 */
+	memset(&ent->e, 0, sizeof(ent->e));
+	ent->e.attr.st_ino = ent->d_ino;
+	if (ent->d_type != DT_DIR)
+		ent->e.attr.st_mode = DTTOIF(ent->d_type);
+}
 
-	return 0;
+static void readdirplus_run(struct readdirplus_job *job)
+{
+	while (1) {
+		int i;
+
+		i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (i >= job->num)
+			break;
+
+		readdirplus_lookup(job, job->ents + i);
+	}
 }
 
-static int splitfs_release(const char *path, struct fuse_file_info *fi)
+static void *readdirplus_thread(void *_dummy)
 {
-	struct splitfs_file_info *fh = (void *)fi->fh;
+	pthread_mutex_lock(&readdirplus_lock);
 
-	free_splitfs_file_info(fh);
+	while (1) {
+		struct readdirplus_job *job;
+
+		if (iv_list_empty(&readdirplus_jobs)) {
+			pthread_cond_wait(&readdirplus_work, &readdirplus_lock);
+			continue;
+		}
+
+		job = iv_list_entry(readdirplus_jobs.next,
+				    struct readdirplus_job, list);
+		if (++job->helpers == job->max_helpers)
+			iv_list_del_init(&job->list);
+		job->users++;
+
+		pthread_mutex_unlock(&readdirplus_lock);
+
+		readdirplus_run(job);
+
+		pthread_mutex_lock(&readdirplus_lock);
+
+		if (--job->users == 0)
+			pthread_cond_broadcast(&readdirplus_idle);
+	}
+
+	return NULL;
+}
+
+static int start_readdirplus_threads(void)
+{
+	int i;
+
+	for (i = 0; i < READDIRPLUS_MAX_THREADS; i++) {
+		pthread_t thr;
+		int ret;
+
+		ret = pthread_create(&thr, NULL, readdirplus_thread, NULL);
+		if (ret) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+			return -1;
+		}
+		pthread_detach(thr);
+	}
+
+	readdirplus_threads = READDIRPLUS_MAX_THREADS;
 
 	return 0;
 }
 
-static int splitfs_readdir(const char *path, void *buf,
-			   fuse_fill_dir_t filler, off_t offset,
-			   struct fuse_file_info *fi,
-			   enum fuse_readdir_flags flags)
+static void readdirplus_lookup_all(struct readdirplus_job *job)
 {
-	int fd;
-	DIR *dirp;
-	int ret;
+	int i;
 
-	if (path[0] != '/') {
-		fprintf(stderr, "readdir called with [%s]\n", path);
-		return -ENOENT;
+	job->next = 0;
+	job->helpers = 0;
+	job->users = 0;
+
+	if (job->num < READDIRPLUS_PARALLEL_MIN || readdirplus_threads == 0) {
+		readdirplus_run(job);
+		return;
 	}
 
-	fd = openat(backing_dir_fd, empty_path(path), O_DIRECTORY | O_RDONLY);
-	if (fd < 0)
-		return -errno;
+	job->max_helpers = job->num / (READDIRPLUS_PARALLEL_MIN / 2);
+	if (job->max_helpers > readdirplus_threads)
+		job->max_helpers = readdirplus_threads;
 
-	dirp = fdopendir(fd);
-	if (dirp == NULL) {
-		ret = -errno;
-		close(fd);
-		return ret;
+	pthread_mutex_lock(&readdirplus_lock);
+	iv_list_add_tail(&job->list, &readdirplus_jobs);
+	for (i = 0; i < job->max_helpers; i++)
+		pthread_cond_signal(&readdirplus_work);
+	pthread_mutex_unlock(&readdirplus_lock);
+
+	readdirplus_run(job);
+
+	pthread_mutex_lock(&readdirplus_lock);
+	if (!iv_list_empty(&job->list))
+		iv_list_del_init(&job->list);
+	while (job->users)
+		pthread_cond_wait(&readdirplus_idle, &readdirplus_lock);
+	pthread_mutex_unlock(&readdirplus_lock);
+}
+
+static void __splitfs_readdirplus(fuse_req_t req, fuse_ino_t ino,
+				  size_t size, off_t offset,
+				  struct fuse_file_info *fi)
+{
+	struct splitfs_dir *d = (void *)fi->fh;
+	struct readdirplus_job job;
+	int alloc;
+	char *buf;
+	char *p;
+	size_t rem;
+	int err;
+	int i;
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
 	}
 
-	ret = 0;
-	while (1) {
-		struct dirent *dent;
+	if (offset != d->offset) {
+		seekdir(d->dirp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
 
-		errno = 0;
+	/*
+	 * Each entry takes up at least 152 bytes plus its name.
+	 */
+	alloc = size / 160 + 1;
+
+	job.dir = get_inode(ino);
+	job.ents = malloc(alloc * sizeof(*job.ents));
+	job.num = 0;
+	if (job.ents == NULL) {
+		free(buf);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
 
-		dent = readdir(dirp);
-		if (dent == NULL) {
-			ret = -errno;
+	err = 0;
+	while (job.num < alloc) {
+		struct readdirplus_entry *ent;
+
+		if (d->entry == NULL) {
+			errno = 0;
+
+			d->entry = readdir(d->dirp);
+			if (d->entry == NULL) {
+				err = errno;
+				break;
+			}
+		}
+
+		ent = job.ents + job.num;
+
+		ent->name = strdup(d->entry->d_name);
+		if (ent->name == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		ent->offset = d->entry->d_off;
+		ent->d_ino = d->entry->d_ino;
+		ent->d_type = d->entry->d_type;
+
+		d->entry = NULL;
+		job.num++;
+	}
+
+	readdirplus_lookup_all(&job);
+
+	p = buf;
+	rem = size;
+	for (i = 0; i < job.num; i++) {
+		struct readdirplus_entry *ent = job.ents + i;
+		size_t entsize;
+
+		entsize = fuse_add_direntry_plus(req, p, rem, ent->name,
+						 &ent->e, ent->offset);
+		if (entsize > rem)
 			break;
+
+		p += entsize;
+		rem -= entsize;
+
+		d->offset = ent->offset;
+	}
+
+	/*
+	 * Drop the lookup references for entries that didn't fit,
+	 * and rewind to the first of them.
+	 */
+	if (i < job.num) {
+		int j;
+
+		for (j = i; j < job.num; j++) {
+			if (job.ents[j].e.ino)
+				forget_inode(get_inode(job.ents[j].e.ino), 1);
 		}
 
-		filler(buf, dent->d_name, NULL, 0, 0);
+		seekdir(d->dirp, d->offset);
 	}
 
-	closedir(dirp);
+	/*
+	 * An empty reply means end of directory, so if not even the
+	 * first entry fits, say so instead.
+	 */
+	if (job.num && i == 0)
+		fuse_reply_err(req, EINVAL);
+	else if (err && rem == size)
+		fuse_reply_err(req, err);
+	else
+		fuse_reply_buf(req, buf, size - rem);
+
+	for (i = 0; i < job.num; i++)
+		free(job.ents[i].name);
+	free(job.ents);
+	free(buf);
+}
 
-	return ret;
+static void splitfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+				off_t offset, struct fuse_file_info *fi)
+{
+	uint64_t start = stat_start();
+
+	__splitfs_readdirplus(req, ino, size, offset, fi);
+
+	stat_end(STAT_READDIRPLUS, start);
+}
+
+static void splitfs_releasedir(fuse_req_t req, fuse_ino_t ino,
+			       struct fuse_file_info *fi)
+{
+	struct splitfs_dir *d = (void *)fi->fh;
+
+	closedir(d->dirp);
+	free(d);
+
+	fuse_reply_err(req, 0);
+}
+
+static void splitfs_init(void *userdata, struct fuse_conn_info *conn)
+{
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+
+	if (conn->capable & FUSE_CAP_READDIRPLUS)
+		conn->want |= FUSE_CAP_READDIRPLUS;
+
+	if (immutable && (conn->capable & FUSE_CAP_CACHE_SYMLINKS))
+		conn->want |= FUSE_CAP_CACHE_SYMLINKS;
+
+#ifdef FUSE_CAP_PASSTHROUGH
+	if (passthrough && (conn->capable & FUSE_CAP_PASSTHROUGH))
+		conn->want |= FUSE_CAP_PASSTHROUGH;
+	else
+		passthrough = 0;
+#else
+	passthrough = 0;
+#endif
+}
+
+static void handle_inotify_event(const struct inotify_event *ev)
+{
+	struct splitfs_inode *inode;
+	fuse_ino_t ino;
+	struct stat buf;
+
+	pthread_mutex_lock(&inodes_lock);
+
+	inode = NULL;
+	if (ev->wd >= 0 && ev->wd < watches_alloc)
+		inode = watches[ev->wd];
+
+	if (inode != NULL && (ev->mask & IN_IGNORED)) {
+		watches[ev->wd] = NULL;
+		inode->wd = -1;
+		inode = NULL;
+	}
+
+	if (inode != NULL)
+		inode->nlookup++;
+
+	pthread_mutex_unlock(&inodes_lock);
+
+	if (inode == NULL)
+		return;
+
+	ino = inode_number(inode);
+
+	if (is_fragmented_file_dir(inode->fd) > 0) {
+		fuse_lowlevel_notify_inval_inode(se, ino, 0, 0);
+		forget_inode(inode, 1);
+		return;
+	}
+
+	if (!ev->len) {
+		forget_inode(inode, 1);
+		return;
+	}
+
+	if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+		fuse_lowlevel_notify_inval_entry(se, ino, ev->name,
+						 strlen(ev->name));
+		fuse_lowlevel_notify_inval_inode(se, ino, -1, 0);
+	}
+
+	if (fstatat(inode->fd, ev->name, &buf, AT_SYMLINK_NOFOLLOW) == 0) {
+		struct splitfs_inode *child;
+
+		pthread_mutex_lock(&inodes_lock);
+
+		child = find_inode(buf.st_dev, buf.st_ino);
+		if (child != NULL)
+			child->nlookup++;
+
+		pthread_mutex_unlock(&inodes_lock);
+
+		if (child != NULL) {
+			fuse_lowlevel_notify_inval_inode(se,
+				inode_number(child), 0, 0);
+			forget_inode(child, 1);
+		}
+	}
+
+	forget_inode(inode, 1);
+}
+
+static void *inotify_thread(void *_dummy)
+{
+	char buf[65536]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while (1) {
+		ssize_t len;
+		char *p;
+
+		len = read(inotify_fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			break;
+		}
+
+		p = buf;
+		while (p < buf + len) {
+			struct inotify_event *ev = (void *)p;
+
+			handle_inotify_event(ev);
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+
+	return NULL;
 }
 
-static struct fuse_operations splitfs_oper = {
+static struct fuse_lowlevel_ops splitfs_oper = {
+	.init		= splitfs_init,
+	.lookup		= splitfs_lookup,
+	.forget		= splitfs_forget,
+	.forget_multi	= splitfs_forget_multi,
 	.getattr	= splitfs_getattr,
+	.setattr	= splitfs_setattr,
 	.readlink	= splitfs_readlink,
-	.truncate	= splitfs_truncate,
 	.open		= splitfs_open,
 	.read		= splitfs_read,
+	.write		= splitfs_write,
 	.statfs		= splitfs_statfs,
 	.release	= splitfs_release,
+	.fsync		= splitfs_fsync,
+	.lseek		= splitfs_lseek,
+	.copy_file_range = splitfs_copy_file_range,
+	.opendir	= splitfs_opendir,
 	.readdir	= splitfs_readdir,
+	.readdirplus	= splitfs_readdirplus,
+	.releasedir	= splitfs_releasedir,
 };
 
+/*
+ * Without -f, stderr points at /dev/null after fuse_daemonize(), so
+ * the statistics dump goes to syslog, one line per message.
+ */
+static void syslog_stats(void)
+{
+	char *buf;
+	size_t length;
+	FILE *fp;
+	char *line;
+	char *next;
+
+	fp = open_memstream(&buf, &length);
+	if (fp == NULL)
+		return;
+	print_stats(fp);
+	fclose(fp);
+
+	for (line = buf; *line; line = next) {
+		next = strchrnul(line, '\n');
+		if (*next)
+			*next++ = 0;
+		if (*line)
+			syslog(LOG_INFO, "%s", line);
+	}
+
+	free(buf);
+}
+
+/*
+ * SIGUSR1 is blocked in all threads, and is picked up synchronously
+ * by this thread, so that the statistics can be printed with stdio.
+ */
+static void *stats_signal_thread(void *_foreground)
+{
+	int foreground = (int)(intptr_t)_foreground;
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+
+	while (1) {
+		int sig;
+
+		if (sigwait(&set, &sig) || sig != SIGUSR1)
+			continue;
+
+		if (foreground) {
+			print_stats(stderr);
+			fflush(stderr);
+		} else {
+			syslog_stats();
+		}
+	}
+
+	return NULL;
+}
+
+static int start_stats_signal_thread(int foreground)
+{
+	sigset_t set;
+	pthread_t thr;
+	int ret;
+
+	/*
+	 * This has to happen before any other threads are created,
+	 * so that they all inherit the blocked signal mask.
+	 */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	if (!foreground)
+		openlog("splitfs", LOG_PID, LOG_DAEMON);
+
+	ret = pthread_create(&thr, NULL, stats_signal_thread,
+			     (void *)(intptr_t)foreground);
+	if (ret) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+		return -1;
+	}
+	pthread_detach(thr);
+
+	return 0;
+}
+
 static void usage(const char *progname)
 {
 	fprintf(stderr,
@@ -549,6 +4556,22 @@ static void usage(const char *progname)
 "         --help            print help\n"
 "    -V   --version         print version\n"
 "    -h   --hash-algo=x     hash algorithm\n"
+"         --store=DIR       fragment store for recipe files\n"
+"         --readahead=N     fragments to prefetch for sequential reads\n"
+"                           (default: 4)\n"
+"         --immutable       let the kernel cache data, attributes and\n"
+"                           directory entries\n"
+"         --writable        allow writing to plain and fragmented files\n"
+"         --mmap=N          map fragments into memory, using up to N MiB\n"
+"                           of address space (default: 0, disabled)\n"
+"         --zcache=N        cache up to N MiB of decompressed fragments\n"
+"                           from compressed stores (default: 64)\n"
+"         --no-passthrough  serve plain files through splitfs even if\n"
+"                           the kernel supports FUSE passthrough\n"
+"\n"
+"Operation and read path statistics can be read from the /" STATS_NAME "\n"
+"file in the mount, and are printed on SIGUSR1, to stderr when running\n"
+"in the foreground and to syslog otherwise.\n"
 "\n", progname);
 }
 
@@ -558,10 +4581,26 @@ enum {
 };
 
 struct splitfs_param {
-	char	*backing_dir;
+	char		*backing_dir;
+	char		*store_dir;
+	unsigned int	readahead;
+	int		immutable;
+	unsigned int	mmap_mb;
+	int		writable;
+	unsigned int	zcache_mb;
+	int		no_passthrough;
 };
 
+#define SPLITFS_OPT(t, p)	{ t, offsetof(struct splitfs_param, p), 1 }
+
 static struct fuse_opt opts[] = {
+	SPLITFS_OPT("--store=%s",	store_dir),
+	SPLITFS_OPT("--readahead=%u",	readahead),
+	SPLITFS_OPT("--immutable",	immutable),
+	SPLITFS_OPT("--mmap=%u",	mmap_mb),
+	SPLITFS_OPT("--writable",	writable),
+	SPLITFS_OPT("--zcache=%u",	zcache_mb),
+	SPLITFS_OPT("--no-passthrough",	no_passthrough),
 	FUSE_OPT_KEY("--help",		KEY_HELP),
 	FUSE_OPT_KEY("-V",		KEY_VERSION),
 	FUSE_OPT_KEY("--version",	KEY_VERSION),
@@ -583,15 +4622,14 @@ static int opt_proc(void *data, const char *arg, int key,
 
 	if (key == KEY_HELP) {
 		usage(outargs->argv[0]);
-		fuse_opt_add_arg(outargs, "-ho");
-		fuse_main(outargs->argc, outargs->argv, &splitfs_oper, NULL);
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
 		exit(EXIT_FAILURE);
 	}
 
 	if (key == KEY_VERSION) {
 		fprintf(stderr, "splitfs version: %s\n", PACKAGE_VERSION);
-		fuse_opt_add_arg(outargs, "--version");
-		fuse_main(outargs->argc, outargs->argv, &splitfs_oper, NULL);
+		fuse_lowlevel_version();
 		exit(EXIT_SUCCESS);
 	}
 
@@ -602,13 +4640,31 @@ int main(int argc, char *argv[])
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	struct splitfs_param param;
+	struct fuse_cmdline_opts cmdline;
+	struct rlimit rlim;
 	int ret;
 
 	memset(&param, 0, sizeof(param));
+	param.readahead = readahead_frags;
+	param.zcache_mb = zcache_max_bytes >> 20;
+
+	INIT_IV_AVL_TREE(&inodes, compare_inodes);
+	INIT_IV_AVL_TREE(&layouts, compare_layouts);
+	INIT_IV_LIST_HEAD(&layouts_lru);
+	init_mapping_shards();
 
 	if (fuse_opt_parse(&args, &param, opts, opt_proc) < 0)
 		return 1;
 
+	if (fuse_parse_cmdline(&args, &cmdline) < 0)
+		return 1;
+
+	if (cmdline.mountpoint == NULL) {
+		fprintf(stderr, "missing mountpoint\n");
+		fprintf(stderr, "see '%s --help' for usage\n", argv[0]);
+		return 1;
+	}
+
 	if (param.backing_dir == NULL) {
 		fprintf(stderr, "missing backing dir\n");
 		fprintf(stderr, "see '%s --help' for usage\n", argv[0]);
@@ -621,10 +4677,109 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	ret = fuse_main(args.argc, args.argv, &splitfs_oper, NULL);
+	/*
+	 * Every open file can hold up to FD_CACHE_SIZE fragment fds
+	 * open, so allow ourselves as many fds as we are permitted.
+	 */
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 &&
+	    rlim.rlim_cur < rlim.rlim_max) {
+		rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+
+	if (param.store_dir != NULL) {
+		store_dir_fd = open(param.store_dir, O_RDONLY | O_DIRECTORY);
+		if (store_dir_fd < 0) {
+			perror("open");
+			return 1;
+		}
+	}
+
+	if (param.immutable && param.writable) {
+		fprintf(stderr, "--immutable and --writable are mutually "
+				"exclusive\n");
+		return 1;
+	}
+
+	readahead_frags = param.readahead;
+	writable = param.writable;
+	passthrough = !param.no_passthrough;
+	mappings_max_bytes = (uint64_t)param.mmap_mb << 20;
+	zcache_max_bytes = (uint64_t)param.zcache_mb << 20;
+	pthread_key_create(&dctx_key, free_dctx);
+
+	init_inode(&root_inode);
+	root_inode.fd = backing_dir_fd;
+	root_inode.nlookup = 1;
+
+	init_inode(&stats_inode);
+	stats_inode.fd = -1;
+	stats_inode.nlookup = 1;
+
+	se = fuse_session_new(&args, &splitfs_oper, sizeof(splitfs_oper), NULL);
+	if (se == NULL)
+		return 1;
+
+	if (param.immutable) {
+		immutable = 1;
+		cache_timeout = 86400.0;
+
+		inotify_fd = inotify_init1(IN_CLOEXEC);
+		if (inotify_fd < 0) {
+			perror("inotify_init1");
+			return 1;
+		}
+
+		watch_inode(&root_inode);
+	}
+
+	if (fuse_set_signal_handlers(se) < 0)
+		return 1;
+
+	if (fuse_session_mount(se, cmdline.mountpoint) < 0)
+		return 1;
+
+	fuse_daemonize(cmdline.foreground);
+
+	if (start_stats_signal_thread(cmdline.foreground) < 0)
+		return 1;
+
+	if (start_readdirplus_threads() < 0)
+		return 1;
+
+	/*
+	 * Start the inotify thread only after daemonizing, as threads
+	 * do not survive the fork.
+	 */
+	if (inotify_fd >= 0) {
+		pthread_t thr;
+
+		ret = pthread_create(&thr, NULL, inotify_thread, NULL);
+		if (ret) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+			return 1;
+		}
+		pthread_detach(thr);
+	}
+
+	if (cmdline.singlethread) {
+		ret = fuse_session_loop(se);
+	} else {
+		struct fuse_loop_config config;
+
+		config.clone_fd = cmdline.clone_fd;
+		config.max_idle_threads = cmdline.max_idle_threads;
+		ret = fuse_session_loop_mt(se, &config);
+	}
+
+	fuse_session_unmount(se);
+	fuse_remove_signal_handlers(se);
+	fuse_session_destroy(se);
 
 	fuse_opt_free_args(&args);
+	free(cmdline.mountpoint);
 	free(param.backing_dir);
+	free(param.store_dir);
 
-	return ret;
+	return ret ? 1 : 0;
 }
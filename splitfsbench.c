@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "common.h"
+
+#define SEQ_READ_SIZE		1048576
+#define MAX_READ_SIZES		16
+
+static int num_reads = 10000;
+static int num_sizes;
+static size_t read_sizes[MAX_READ_SIZES];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t xorshift64(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return x;
+}
+
+static int compare_u64(const void *_a, const void *_b)
+{
+	const uint64_t *a = _a;
+	const uint64_t *b = _b;
+
+	return (*a > *b) - (*a < *b);
+}
+
+static void *xmalloc(size_t size)
+{
+	void *ptr;
+
+	ptr = malloc(size);
+	if (ptr == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return ptr;
+}
+
+static int open_file(const char *file, uint64_t *size)
+{
+	struct stat buf;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+
+	if (fstat(fd, &buf) < 0) {
+		perror("fstat");
+		exit(EXIT_FAILURE);
+	}
+
+	*size = buf.st_size;
+
+	return fd;
+}
+
+/*
+ * Read the whole file front to back.  We drop the file's page cache
+ * first, which for a splitfs file only drops the FUSE-level cache,
+ * not that of the backing fragments, so this measures the cost of
+ * going through splitfs rather than that of the underlying disk.
+ */
+static double bench_sequential(int fd, uint64_t size, int reffd)
+{
+	char *buf;
+	char *refbuf;
+	uint64_t offset;
+	uint64_t start;
+	uint64_t elapsed;
+
+	buf = xmalloc(SEQ_READ_SIZE);
+	refbuf = (reffd >= 0) ? xmalloc(SEQ_READ_SIZE) : NULL;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+	elapsed = 0;
+	for (offset = 0; offset < size; offset += SEQ_READ_SIZE) {
+		size_t toread;
+		ssize_t ret;
+
+		toread = SEQ_READ_SIZE;
+		if (toread > size - offset)
+			toread = size - offset;
+
+		start = now_ns();
+		ret = xpread(fd, buf, toread, offset);
+		elapsed += now_ns() - start;
+
+		if (ret != toread) {
+			fprintf(stderr, "short read at %" PRIu64 "\n", offset);
+			exit(EXIT_FAILURE);
+		}
+
+		if (refbuf != NULL &&
+		    (xpread(reffd, refbuf, toread, offset) != toread ||
+		     memcmp(buf, refbuf, toread))) {
+			fprintf(stderr, "data mismatch at %" PRIu64 "\n",
+				offset);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	free(refbuf);
+	free(buf);
+
+	return elapsed ? (double)size * 1000 / elapsed : 0;
+}
+
+/*
+ * Issue num_reads reads of read_size bytes each at random offsets
+ * aligned to the read size, as a VM guest doing block I/O would, and
+ * record the latency of each.
+ */
+static void bench_random(const char *name, int fd, uint64_t size,
+			 size_t read_size, int reffd)
+{
+	uint64_t *lat;
+	char *buf;
+	char *refbuf;
+	uint64_t num_blocks;
+	uint64_t state;
+	uint64_t total;
+	int i;
+
+	num_blocks = size / read_size;
+	if (num_blocks == 0)
+		return;
+
+	lat = xmalloc(num_reads * sizeof(*lat));
+	buf = xmalloc(read_size);
+	refbuf = (reffd >= 0) ? xmalloc(read_size) : NULL;
+
+	state = 0x9e3779b97f4a7c15ULL;
+	total = 0;
+	for (i = 0; i < num_reads; i++) {
+		uint64_t offset;
+		uint64_t start;
+		ssize_t ret;
+
+		offset = (xorshift64(&state) % num_blocks) * read_size;
+
+		start = now_ns();
+		ret = xpread(fd, buf, read_size, offset);
+		lat[i] = now_ns() - start;
+		total += lat[i];
+
+		if (ret != read_size) {
+			fprintf(stderr, "short read at %" PRIu64 "\n", offset);
+			exit(EXIT_FAILURE);
+		}
+
+		if (refbuf != NULL &&
+		    (xpread(reffd, refbuf, read_size, offset) != read_size ||
+		     memcmp(buf, refbuf, read_size))) {
+			fprintf(stderr, "data mismatch at %" PRIu64 "\n",
+				offset);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	qsort(lat, num_reads, sizeof(*lat), compare_u64);
+
+	printf("%-12s %8zu %10.0f %10.1f %10.1f %10.1f %10.1f\n",
+	       name, read_size, (double)num_reads * 1e9 / total,
+	       lat[num_reads / 2] / 1000.0,
+	       lat[(uint64_t)num_reads * 99 / 100] / 1000.0,
+	       lat[(uint64_t)num_reads * 999 / 1000] / 1000.0,
+	       lat[num_reads - 1] / 1000.0);
+
+	free(refbuf);
+	free(buf);
+	free(lat);
+}
+
+static void parse_sizes(char *arg)
+{
+	char *tok;
+	char *saveptr;
+
+	num_sizes = 0;
+	for (tok = strtok_r(arg, ",", &saveptr); tok != NULL;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		char *end;
+		unsigned long long size;
+
+		if (num_sizes == MAX_READ_SIZES) {
+			fprintf(stderr, "too many read sizes\n");
+			exit(EXIT_FAILURE);
+		}
+
+		size = strtoull(tok, &end, 0);
+		if (*end == 'k' || *end == 'K') {
+			size <<= 10;
+			end++;
+		} else if (*end == 'm' || *end == 'M') {
+			size <<= 20;
+			end++;
+		}
+
+		if (*end || size == 0) {
+			fprintf(stderr, "invalid read size: %s\n", tok);
+			exit(EXIT_FAILURE);
+		}
+
+		read_sizes[num_sizes++] = size;
+	}
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "syntax: %s [-n reads] [-s size[,size...]] <file> "
+			"[<original>]\n", progname);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *file;
+	const char *orig;
+	int opt;
+	int fd;
+	int origfd;
+	uint64_t size;
+	uint64_t origsize;
+	double mbps;
+	int i;
+
+	read_sizes[0] = 4096;
+	read_sizes[1] = 65536;
+	read_sizes[2] = 1048576;
+	num_sizes = 3;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			num_reads = atoi(optarg);
+			if (num_reads <= 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 's':
+			parse_sizes(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - optind != 1 && argc - optind != 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	file = argv[optind];
+	orig = (argc - optind == 2) ? argv[optind + 1] : NULL;
+
+	fd = open_file(file, &size);
+
+	origfd = -1;
+	if (orig != NULL) {
+		origfd = open_file(orig, &origsize);
+		if (origsize != size) {
+			fprintf(stderr, "size mismatch: %" PRIu64 " vs %"
+				PRIu64 "\n", size, origsize);
+			return 1;
+		}
+	}
+
+	printf("%-12s %10s\n", "file", "MB/s");
+
+	mbps = bench_sequential(fd, size, origfd);
+	printf("%-12s %10.1f\n", "splitfs", mbps);
+
+	if (origfd >= 0) {
+		double origmbps;
+
+		origmbps = bench_sequential(origfd, size, -1);
+		printf("%-12s %10.1f\n", "original", origmbps);
+	}
+
+	printf("\n%-12s %8s %10s %10s %10s %10s %10s\n", "file", "size",
+	       "IOPS", "p50 us", "p99 us", "p999 us", "max us");
+
+	for (i = 0; i < num_sizes; i++) {
+		bench_random("splitfs", fd, size, read_sizes[i], origfd);
+		if (origfd >= 0)
+			bench_random("original", origfd, size,
+				     read_sizes[i], -1);
+	}
+
+	if (origfd >= 0)
+		close(origfd);
+	close(fd);
+
+	return 0;
+}
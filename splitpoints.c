@@ -4,6 +4,7 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -12,27 +13,87 @@
 #include "splitpoints.h"
 
 #define DIV_ROUND_UP(a, b)	(((a) + (b) - 1) / (b))
+#define ROUND_UP(x, y)		(DIV_ROUND_UP(x, y) * (y))
 
 #define BLOCK_SIZE		16777216
 
-static bool should_split_at(struct split_job *sj, uint8_t *buf, int off)
+/*
+ * Position off is a split point for every level whose threshold is
+ * at least the value returned here.
+ */
+static uint32_t split_hash(struct split_job *sj, uint8_t *buf, int off)
 {
 #if 1
-	uint32_t crc;
-
-	crc = crc32c(0, buf + off, sj->crc_block_size);
-	if (crc <= sj->crc_thresh)
-		return true;
-
-	return false;
+	return crc32c(0, buf + off, sj->crc_block_size);
 #else
 	if (off && buf[off - 1] == '\n' && buf[off] == '>')
-		return true;
+		return 0;
 
-	return false;
+	return UINT32_MAX;
 #endif
 }
 
+struct level_offsets {
+	size_t		alloc;
+	size_t		num;
+	uint64_t	*offsets;
+};
+
+static void add_split_offset(struct level_offsets *lo, uint64_t offset)
+{
+	if (lo->num == lo->alloc) {
+		lo->alloc *= 2;
+
+		lo->offsets = realloc(lo->offsets,
+				      lo->alloc * sizeof(*lo->offsets));
+		if (lo->offsets == NULL)
+			exit(EXIT_FAILURE);
+	}
+
+	lo->offsets[lo->num++] = offset;
+}
+
+/*
+ * Add split points to the split offsets of a block that ends at end,
+ * so that no fragment is longer than max_size.  Where these go depends
+ * on where the previous fragment started, so this has to be done in
+ * file order, once offsets[0] is known.
+ */
+static void add_forced_splits(struct level_offsets *lo, uint64_t max_size,
+			      uint64_t end)
+{
+	uint64_t *offsets;
+	uint64_t last;
+	size_t num;
+	size_t i;
+
+	num = lo->num;
+
+	offsets = malloc(num * sizeof(*offsets));
+	if (offsets == NULL)
+		exit(EXIT_FAILURE);
+	memcpy(offsets, lo->offsets, num * sizeof(*offsets));
+
+	lo->num = 1;
+	last = offsets[0];
+	for (i = 1; i < num; i++) {
+		while (offsets[i] - last > max_size) {
+			last += max_size;
+			add_split_offset(lo, last);
+		}
+
+		add_split_offset(lo, offsets[i]);
+		last = offsets[i];
+	}
+
+	while (end - last > max_size) {
+		last += max_size;
+		add_split_offset(lo, last);
+	}
+
+	free(offsets);
+}
+
 static void *split_thread(void *_me)
 {
 	struct worker_thread *me = _me;
@@ -40,8 +101,8 @@ static void *split_thread(void *_me)
 	int fd;
 	size_t buf_size;
 	uint8_t *buf;
-	size_t split_offsets_num;
-	uint64_t *split_offsets;
+	struct level_offsets lo[SPLIT_MAX_LEVELS];
+	int l;
 
 	fd = open(sj->file, O_RDONLY);
 	if (fd < 0) {
@@ -55,19 +116,28 @@ static void *split_thread(void *_me)
 	if (buf == NULL)
 		exit(EXIT_FAILURE);
 
-	split_offsets_num = DIV_ROUND_UP(0x100000000LL, sj->crc_thresh);
-	split_offsets_num = DIV_ROUND_UP(BLOCK_SIZE, split_offsets_num);
-	split_offsets_num *= 4;
+	for (l = 0; l < sj->num_levels; l++) {
+		struct split_level *level = sj->levels + l;
+		size_t num;
 
-	split_offsets = malloc(split_offsets_num * sizeof(*split_offsets));
-	if (split_offsets == NULL)
-		exit(EXIT_FAILURE);
+		if (level->block_size) {
+			num = BLOCK_SIZE / level->block_size + 2;
+		} else {
+			num = DIV_ROUND_UP(0x100000000LL,
+					   level->crc_thresh + 1ULL);
+			num = DIV_ROUND_UP(BLOCK_SIZE, num) * 4;
+		}
+
+		lo[l].alloc = num;
+		lo[l].offsets = malloc(num * sizeof(*lo[l].offsets));
+		if (lo[l].offsets == NULL)
+			exit(EXIT_FAILURE);
+	}
 
 	while (1) {
 		uint64_t off;
 		size_t toread;
 		ssize_t ret;
-		size_t num;
 		size_t i;
 
 		xsem_wait(&me->sem0);
@@ -96,37 +166,73 @@ static void *split_thread(void *_me)
 		if (ret != toread)
 			exit(EXIT_FAILURE);
 
-		num = 1;
-		for (i = off ? 0 : 1; i <= toread - sj->crc_block_size; i++) {
-			if (!should_split_at(sj, buf, i))
+		for (l = 0; l < sj->num_levels; l++)
+			lo[l].num = 1;
+
+		for (i = off ? 0 : 1; sj->num_crc_levels &&
+		     i + sj->crc_block_size <= toread; i++) {
+			uint32_t hash;
+
+			hash = split_hash(sj, buf, i);
+			if (hash > sj->max_crc_thresh)
 				continue;
 
-			if (num == split_offsets_num) {
-				split_offsets_num *= 2;
+			for (l = 0; l < sj->num_levels; l++) {
+				struct split_level *level = sj->levels + l;
 
-				split_offsets = realloc(split_offsets,
-					split_offsets_num *
-						sizeof(*split_offsets));
-				if (split_offsets == NULL)
-					exit(EXIT_FAILURE);
+				if (!level->block_size &&
+				    hash <= level->crc_thresh) {
+					add_split_offset(lo + l, off + i);
+				}
 			}
-			split_offsets[num++] = off + i;
+		}
+
+		for (l = 0; l < sj->num_levels; l++) {
+			uint32_t bs = sj->levels[l].block_size;
+			uint64_t end;
+			uint64_t p;
+
+			if (!bs)
+				continue;
+
+			end = off + BLOCK_SIZE;
+			if (end > sj->file_size)
+				end = sj->file_size;
+
+			for (p = ROUND_UP(off ? off : 1, bs); p < end; p += bs)
+				add_split_offset(lo + l, p);
 		}
 
 		xsem_wait(&me->sem1);
 
-		split_offsets[0] = sj->prev_splitpoint;
-		sj->prev_splitpoint = split_offsets[num - 1];
+		for (l = 0; l < sj->num_levels; l++) {
+			struct split_level *level = sj->levels + l;
+
+			lo[l].offsets[0] = level->prev_splitpoint;
+			if (level->max_size) {
+				uint64_t end;
+
+				end = off + BLOCK_SIZE;
+				if (end > sj->file_size)
+					end = sj->file_size;
+
+				add_forced_splits(lo + l, level->max_size, end);
+			}
+			level->prev_splitpoint = lo[l].offsets[lo[l].num - 1];
+		}
 
 		xsem_post(&me->next->sem1);
 
-		if (num > 1) {
-			sj->handler_split(sj->cookie, fd,
-					  num - 1, split_offsets);
+		for (l = 0; l < sj->num_levels; l++) {
+			if (lo[l].num > 1) {
+				sj->handler_split(sj->levels[l].cookie, fd,
+						  lo[l].num - 1, lo[l].offsets);
+			}
 		}
 	}
 
-	free(split_offsets);
+	for (l = 0; l < sj->num_levels; l++)
+		free(lo[l].offsets);
 	free(buf);
 
 	close(fd);
@@ -134,22 +240,53 @@ static void *split_thread(void *_me)
 	return NULL;
 }
 
-void do_split(struct split_job *sj)
+void do_split_levels(struct split_job *sj)
 {
 	struct stat statbuf;
-	uint64_t off[2];
+	int l;
+
+	if (sj->num_levels < 1 || sj->num_levels > SPLIT_MAX_LEVELS)
+		exit(EXIT_FAILURE);
 
 	if (fstat(sj->fd, &statbuf) < 0)
 		exit(EXIT_FAILURE);
 
 	sj->file_size = statbuf.st_size;
 	sj->file_offset = 0;
-	sj->prev_splitpoint = 0;
+	sj->num_crc_levels = 0;
+	sj->max_crc_thresh = 0;
+	for (l = 0; l < sj->num_levels; l++) {
+		struct split_level *level = sj->levels + l;
+
+		level->prev_splitpoint = 0;
+		if (level->block_size)
+			continue;
+
+		sj->num_crc_levels++;
+		if (sj->max_crc_thresh < level->crc_thresh)
+			sj->max_crc_thresh = level->crc_thresh;
+	}
+
 	run_threads(split_thread, sj);
 
-	off[0] = sj->prev_splitpoint;
-	off[1] = sj->file_size;
-	sj->handler_split(sj->cookie, sj->fd, 1, off);
+	for (l = 0; l < sj->num_levels; l++) {
+		uint64_t off[2];
+
+		off[0] = sj->levels[l].prev_splitpoint;
+		off[1] = sj->file_size;
+		sj->handler_split(sj->levels[l].cookie, sj->fd, 1, off);
+	}
 
 	fprintf(stderr, "\n");
 }
+
+void do_split(struct split_job *sj)
+{
+	sj->num_levels = 1;
+	sj->levels[0].crc_thresh = sj->crc_thresh;
+	sj->levels[0].block_size = 0;
+	sj->levels[0].max_size = 0;
+	sj->levels[0].cookie = sj->cookie;
+
+	do_split_levels(sj);
+}
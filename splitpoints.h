@@ -4,6 +4,54 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include "crc32c.h"
+
+/*
+ * Default content-defined chunking parameters: a split point is
+ * placed before every position at which the CRC32C of the following
+ * SPLIT_CRC_BLOCK_SIZE bytes is at most SPLIT_CRC_THRESH, giving
+ * fragments of about 1 MiB on average.
+ */
+#define SPLIT_CRC_BLOCK_SIZE	64
+#define SPLIT_CRC_THRESH	0x00001000
+
+/*
+ * Runs of data without any split points would otherwise give
+ * arbitrarily large fragments: in particular, the CRC32C of a block
+ * of zeroes is 0x03c8eb67, so runs of zeroes are never split.  The
+ * fragments that split writes out are therefore cut every
+ * SPLIT_MAX_FRAG_SIZE bytes if no split point occurs before that.
+ */
+#define SPLIT_MAX_FRAG_SIZE	16777216
+
+static inline int is_split_point(const uint8_t *buf, size_t crc_block_size,
+				 uint32_t crc_thresh)
+{
+	return crc32c(0, buf, crc_block_size) <= crc_thresh;
+}
+
+/*
+ * do_split() splits a file at a single threshold, calling the split
+ * handler with the job's cookie.  do_split_levels() instead splits
+ * at each of the thresholds in levels[] in the same pass over the
+ * file, computing the CRC at each position only once, and calls the
+ * split handler with the cookie of the level that the split points
+ * belong to.  A level with a nonzero block_size ignores the CRC and
+ * splits at every multiple of block_size instead, which gives a
+ * fixed-size block baseline for the same pass.  A level with a nonzero
+ * max_size also gets a split point wherever a fragment would otherwise
+ * grow longer than max_size bytes.
+ */
+#define SPLIT_MAX_LEVELS	16
+
+struct split_level {
+	uint32_t	crc_thresh;
+	uint32_t	block_size;
+	uint32_t	max_size;
+	void		*cookie;
+
+	uint64_t	prev_splitpoint;
+};
 
 struct split_job {
 	int		fd;
@@ -14,12 +62,17 @@ struct split_job {
 	void		(*handler_split)(void *cookie, int fd, int num,
 					 uint64_t *split_offsets);
 
+	int		num_levels;
+	struct split_level	levels[SPLIT_MAX_LEVELS];
+
 	uint64_t	file_size;
 	uint64_t	file_offset;
-	uint64_t	prev_splitpoint;
+	int		num_crc_levels;
+	uint32_t	max_crc_thresh;
 };
 
 void do_split(struct split_job *sj);
+void do_split_levels(struct split_job *sj);
 
 
 #endif